@@ -0,0 +1,12 @@
+#!/bin/bash
+# 線形合同法で作った乱数で分岐するループを、if変換あり・なしでコンパイルして実行時間を比べる
+# 分岐予測が当たらないので、cmovを使う方が速くなるはず
+cd "$(dirname "$0")/.."
+
+TIMEFORMAT="%R s"
+for opt in "" "-fno-if-conversion"
+do
+  ./compiler $opt -o tmp bench/ifconv.txt 2> /dev/null
+  echo "${opt:-(default)}"
+  time ./tmp
+done
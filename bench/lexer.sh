@@ -0,0 +1,20 @@
+#!/bin/bash
+# 大きな入力のトークナイズにかかる時間を、スレッド数を変えて比べる
+# トークンごとには何も出力しない-lex-onlyで、トークナイズだけの時間を測る
+cd "$(dirname "$0")/.."
+
+awk 'BEGIN {
+  srand(1)
+  for (k = 0; k < 200000; k++) {
+    printf "a%d = a%d * %d + b;\n", k % 20, (k + 7) % 20, int(rand() * 1000)
+    if (k % 7 == 0) printf "if (a0 >= b) { b = b - 1; } else while (c != 3) c = c + 1;\n"
+  }
+}' > tmp.txt
+
+TIMEFORMAT="%R s"
+for n in 1 2 4 `nproc`
+do
+  echo "-lexer-threads=$n"
+  time ./compiler -lexer-threads=$n -lex-only tmp.txt 2> /dev/null
+done
+rm -f tmp.txt
@@ -0,0 +1,26 @@
+#!/bin/bash
+# 長い式と深く括弧で囲まれた式の構文解析にかかる時間を測る
+# 式の構文解析は再帰しないので、括弧が深くてもスタックは溢れない
+cd "$(dirname "$0")/.."
+
+awk 'BEGIN {
+  for (k = 0; k < 200; k++) {
+    printf "a = b"
+    for (j = 0; j < 500; j++) printf " %s %s", substr("+-*/<>", j % 6 + 1, 1), substr("abcd", j % 4 + 1, 1)
+    printf ";\n"
+  }
+}' > tmp.txt
+awk 'BEGIN {
+  printf "a = "
+  for (k = 0; k < 50000; k++) printf "(-"
+  printf "1"
+  for (k = 0; k < 50000; k++) printf ")"
+  printf ";\n"
+}' > tmp.expected
+
+TIMEFORMAT="%R s"
+echo "long expressions"
+time ./compiler tmp.txt > /dev/null 2>&1
+echo "deeply parenthesized expression"
+time ./compiler tmp.expected > /dev/null 2>&1
+rm -f tmp.txt tmp.expected
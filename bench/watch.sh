@@ -0,0 +1,44 @@
+#!/bin/bash
+# -watchで1つの文を書き換えたときに、出力し直すまでにかかる時間を、最初から全部コンパイルする時間と比べる
+# 時間はコンパイラが報告する、入力を読んでからアセンブリを書き終えるまでの時間
+cd "$(dirname "$0")/.."
+
+gen() {
+  awk -v edit="$1" 'BEGIN {
+    srand(1)
+    if (edit ~ /insert/) printf "a0 = 1;\n"
+    for (k = 0; k < 20000; k++) {
+      r = int(rand() * 1000)
+      if (edit ~ /change/ && k == 10000) printf "a1 = a2 * 3 + b;\n"
+      else printf "a%d = a%d * %d + b;\n", k % 20, (k + 7) % 20, r
+      if (k % 7 == 0) printf "if (a0 >= b) { b = b - 1; } else while (c != 3) c = c + 1;\n"
+    }
+  }'
+}
+gen > tmp.txt
+
+TIMEFORMAT="%R s"
+echo "full compile"
+time ./compiler tmp.txt > /dev/null 2>&1
+
+# 構文解析の経過の表示は捨て、書き出したことの報告だけを残す
+./compiler -watch=tmp.s tmp.txt 2> >(grep --line-buffered "書き出しました" > tmp.actual) &
+watcher=$!
+wait_build() {
+  for k in `seq 300` ; do [ "$(wc -l < tmp.actual)" -ge $1 ] && return ; sleep 0.1 ; done
+}
+wait_build 1
+n=1
+for edit in change change+insert
+do
+  gen $edit > tmp.txt
+  n=$((n + 1))
+  wait_build $n
+  case $edit in
+    change) echo "watch: change one statement" ;;
+    *) echo "watch: insert a line at the top (shifts every line number)" ;;
+  esac
+  tail -1 tmp.actual | sed 's/.*(\(.*\))/\1/'
+done
+kill $watcher
+rm -f tmp.txt tmp.s tmp.actual
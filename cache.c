@@ -0,0 +1,289 @@
+#define _DEFAULT_SOURCE
+#include "header.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// コンパイル結果のキャッシュ(-cache-dir=DIR)
+// 入力の内容、コンパイラの版、出力に影響するオプションのSHA-256をキーにして、出力したアセンブリを
+// DIR/<キー>.s に保存する 同じキーでもう一度コンパイルすると、トークナイズもコード生成もせずに保存したものを出力する
+//
+// 出力は一時ファイルに書いてからrenameで置くので、複数のコンパイラが同時に同じキャッシュを使っても、
+// 書きかけのファイルを読むことはない
+// 合計の大きさが上限(-cache-max)を超えたら、最後に使われた時刻(mtime)の古いものから消す ヒットしたらmtimeを更新する
+// 終了しそこねたプロセスが残した一時ファイルも、古くなったら消す
+// ヒットとミスの回数はDIR/statsに記録し、-cache-statsで表示する ミスはコンパイルして保存できたときに数える
+
+// コンパイラの版 出力が変わる変更をしたら上げる ビルドした時刻もキーに含める
+#define CACHE_VERSION "cc-cache-1 " __DATE__ " " __TIME__
+#define TMP_MAX_AGE 3600    // これより古い(秒)一時ファイルは、書いていたプロセスがもういないものとして消す
+
+char cache_key[65];
+char *cache_tmp;        // 出力を書いている一時ファイル なければNULL
+int cache_saved_stdout; // 一時ファイルに切り替える前の標準出力
+
+// 文字列をキーに加える 区切りの'\0'も含めて、別の組み合わせが同じキーにならないようにする
+void hash_string(Sha256 *s, char *str) {
+    sha256_update(s, str ? str : "", str ? strlen(str) + 1 : 1);
+}
+
+// ファイルの内容をキーに加える 読めなければ読めなかったことを加える
+void hash_file(Sha256 *s, char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        hash_string(s, "(missing)");
+        return;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        sha256_update(s, buf, n);
+    }
+    fclose(fp);
+    hash_string(s, "");
+}
+
+void compute_cache_key(char *path) {
+    Sha256 s;
+    sha256_init(&s);
+    hash_string(&s, CACHE_VERSION);
+    hash_string(&s, path);  // .fileに出力する
+    hash_string(&s, no_if_conversion ? "-fno-if-conversion" : "");
+    hash_string(&s, profile_generate);
+    hash_string(&s, profile_use);
+    if (profile_use) {
+        hash_file(&s, profile_use);
+    }
+    sha256_update(&s, user_input, strlen(user_input));
+    sha256_final(&s, cache_key);
+}
+
+char *cache_path(char *name) {
+    char *buf = malloc(strlen(cache_dir) + strlen(name) + 2);
+    sprintf(buf, "%s/%s", cache_dir, name);
+    return buf;
+}
+
+// statsの回数を1増やす 複数のプロセスが同時に書き換えないようにflockで排他する
+void count_stat(bool hit) {
+    char *path = cache_path("stats");
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    char buf[64] = {0};
+    long hits = 0, misses = 0;
+    if (read(fd, buf, sizeof(buf) - 1) > 0) {
+        sscanf(buf, "%ld %ld", &hits, &misses);
+    }
+    hit ? hits++ : misses++;
+    int len = snprintf(buf, sizeof(buf), "%ld %ld\n", hits, misses);
+    if (pwrite(fd, buf, len, 0) == len) {
+        ftruncate(fd, len);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// キャッシュを引く ヒットしたら保存していたアセンブリを標準出力に書いてtrueを返す
+bool cache_lookup(char *path) {
+    mkdir(cache_dir, 0755);
+    compute_cache_key(path);
+
+    char name[80];
+    sprintf(name, "%s.s", cache_key);
+    char *entry = cache_path(name);
+    int fd = open(entry, O_RDONLY);
+    if (fd < 0) {
+        free(entry);
+        return false;
+    }
+
+    char buf[65536];
+    long n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    close(fd);
+    // 最近使ったことを記録する
+    utimensat(AT_FDCWD, entry, NULL, 0);
+    free(entry);
+    count_stat(true);
+    return true;
+}
+
+// 終了するときに、保存し終えていない一時ファイルを消す(コンパイルエラーで終了した場合)
+void remove_cache_tmp() {
+    if (cache_tmp) {
+        unlink(cache_tmp);
+    }
+}
+
+// これから標準出力に書くアセンブリを、キャッシュの一時ファイルに書くようにする
+void cache_begin() {
+    cache_tmp = cache_path("tmp.XXXXXX");
+    int fd = mkstemp(cache_tmp);
+    if (fd < 0) {
+        free(cache_tmp);
+        cache_tmp = NULL;
+        return;
+    }
+    atexit(remove_cache_tmp);
+    // mkstempは所有者しか読めないファイルを作るので、他のファイルと同じ権限にしておく
+    fchmod(fd, 0644);
+
+    fflush(stdout);
+    cache_saved_stdout = dup(1);
+    dup2(fd, 1);
+    close(fd);
+}
+
+// 大きさの合計が上限を超えていたら、最後に使われた時刻の古いものから消す
+typedef struct {
+    char *name;
+    time_t mtime;
+    long size;
+} CacheEntry;
+
+int compare_entry(const void *a, const void *b) {
+    const CacheEntry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// キャッシュの中の項目を列挙する 合計の大きさをtotalに入れる
+CacheEntry *list_entries(int *count, long *total) {
+    DIR *dir = opendir(cache_dir);
+    int n = 0, cap = 16;
+    CacheEntry *entries = malloc(sizeof(CacheEntry) * cap);
+    *total = 0;
+    if (dir) {
+        for (struct dirent *d; (d = readdir(dir)); ) {
+            int len = strlen(d->d_name);
+            if (len != 66 || strcmp(d->d_name + 64, ".s") != 0) {
+                continue;
+            }
+            char *path = cache_path(d->d_name);
+            struct stat st;
+            if (stat(path, &st) == 0) {
+                if (n == cap) {
+                    cap *= 2;
+                    entries = realloc(entries, sizeof(CacheEntry) * cap);
+                }
+                entries[n++] = (CacheEntry){strdup(d->d_name), st.st_mtime, st.st_size};
+                *total += st.st_size;
+            }
+            free(path);
+        }
+        closedir(dir);
+    }
+    *count = n;
+    return entries;
+}
+
+// 書いていたプロセスが異常終了して残った、古い一時ファイルを消す
+void remove_stale_tmp() {
+    DIR *dir = opendir(cache_dir);
+    if (!dir) {
+        return;
+    }
+    time_t now = time(NULL);
+    for (struct dirent *d; (d = readdir(dir)); ) {
+        if (strncmp(d->d_name, "tmp.", 4) != 0) {
+            continue;
+        }
+        char *path = cache_path(d->d_name);
+        struct stat st;
+        if (stat(path, &st) == 0 && now - st.st_mtime > TMP_MAX_AGE) {
+            unlink(path);
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+void evict() {
+    remove_stale_tmp();
+
+    int n;
+    long total;
+    CacheEntry *entries = list_entries(&n, &total);
+    if (total > cache_max) {
+        qsort(entries, n, sizeof(CacheEntry), compare_entry);
+        for (int i = 0; i < n && total > cache_max; i++) {
+            char *path = cache_path(entries[i].name);
+            // 他のプロセスが先に消していてもかまわない
+            if (unlink(path) == 0 || errno == ENOENT) {
+                total -= entries[i].size;
+            }
+            free(path);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+// 一時ファイルに書いたアセンブリをキャッシュに置き、標準出力にも書き出す
+void cache_commit() {
+    if (!cache_tmp) {
+        return;
+    }
+    fflush(stdout);
+    dup2(cache_saved_stdout, 1);
+    close(cache_saved_stdout);
+
+    int fd = open(cache_tmp, O_RDONLY);
+    char buf[65536];
+    long n;
+    while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    char name[80];
+    sprintf(name, "%s.s", cache_key);
+    char *entry = cache_path(name);
+    if (rename(cache_tmp, entry) == 0) {
+        free(cache_tmp);
+        cache_tmp = NULL;
+        count_stat(false);
+    }
+    free(entry);
+    evict();
+}
+
+// -cache-stats キャッシュの使われ方を表示する
+void print_cache_stats() {
+    long hits = 0, misses = 0;
+    char *path = cache_path("stats");
+    FILE *fp = fopen(path, "r");
+    free(path);
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &hits, &misses) != 2) {
+            hits = misses = 0;
+        }
+        fclose(fp);
+    }
+
+    int n;
+    long total;
+    CacheEntry *entries = list_entries(&n, &total);
+    for (int i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+
+    printf("hits: %ld\n", hits);
+    printf("misses: %ld\n", misses);
+    printf("entries: %d\n", n);
+    printf("size: %ld / %ld bytes\n", total, cache_max);
+}
@@ -0,0 +1,207 @@
+#define _DEFAULT_SOURCE
+#include "header.h"
+
+// 文(codeの要素)ごとのコード生成
+// 各文のコードはその文だけのバッファに出力し、文の順に書き出す
+// ラベルの名前は文ごとに決まるので(emitter.c)、どの順に、どのスレッドで生成しても出力は同じになる
+//
+// -codegen-threads=Nでは、文をN個のスレッドで並列に生成する(ワークスティーリング)
+//   各スレッドは担当する文の範囲を持ち、先頭から1つずつ取り出して生成する
+//   自分の範囲がなくなったら、他のスレッドの範囲の後ろ半分を盗む
+//   範囲は[begin, end)を1つの64ビット整数に詰め、CASで書き換える
+//   生成中のエラーでは、そのスレッドから終了しない エラーになった文に印を付けてスレッドを止め、
+//   すべてのスレッドを待ってからmainのスレッドで終了する
+
+typedef struct {
+    _Alignas(64) atomic_ullong range; // 上位32ビットがbegin、下位32ビットがend
+} Worker;
+
+Worker *workers;
+int worker_count;
+RootOut *root_outs;
+atomic_bool codegen_failed;  // どれかの文でエラーになったので、残りの文は生成しない
+
+// 文rootのコードを生成し、outに入れる
+void gen_root(int root, Node *node, RootOut *out) {
+    FILE *prev = asm_out;
+    FILE *fp = open_memstream(&out->buf, &out->len);
+    if (!fp) {
+        error("出力用のバッファを作れません");
+    }
+
+    // エラーで抜けるときも、バッファを捨てて出力先を戻してから呼び出し側へ戻る
+    jmp_buf *outer = error_jmp;
+    jmp_buf jb;
+    if (outer && setjmp(jb)) {
+        error_jmp = outer;
+        fclose(fp);
+        free(out->buf);
+        out->buf = NULL;
+        out->failed = true;
+        asm_out = prev;
+        longjmp(*outer, 1);
+    }
+    if (outer) {
+        error_jmp = &jb;
+    }
+
+    begin_root(root, fp);
+    gen(node);
+    end_root();
+    out->used_cold = used_cold;
+    fclose(fp);
+    asm_out = prev;
+    error_jmp = outer;
+}
+
+// 文のコードを標準出力に書き出す バッファは呼び出し側で解放する
+void write_root(RootOut *out) {
+    if (out->used_cold && !cold_started) {
+        // サブセクション1の先頭、つまり最初に追い出されたコードの位置にmain.coldを置く
+        printf("  .subsection 1\n");
+        printf("main.cold:\n");
+        printf("  .subsection 0\n");
+        cold_started = true;
+    }
+    fwrite(out->buf, 1, out->len, stdout);
+}
+
+unsigned long long pack_range(unsigned begin, unsigned end) {
+    return (unsigned long long) begin << 32 | end;
+}
+
+// 自分の範囲の先頭から文を1つ取り出す
+bool take_root(Worker *w, int *root) {
+    unsigned long long r = atomic_load(&w->range);
+    for (;;) {
+        unsigned begin = r >> 32;
+        unsigned end = (unsigned) r;
+        if (begin >= end) {
+            return false;
+        }
+        if (atomic_compare_exchange_weak(&w->range, &r, pack_range(begin + 1, end))) {
+            *root = begin;
+            return true;
+        }
+    }
+}
+
+// victimの範囲の後ろ半分を盗んで自分の範囲にする 自分の範囲は空になっていること
+bool steal_roots(Worker *self, Worker *victim) {
+    unsigned long long r = atomic_load(&victim->range);
+    for (;;) {
+        unsigned begin = r >> 32;
+        unsigned end = (unsigned) r;
+        if (begin >= end) {
+            return false;
+        }
+        unsigned mid = begin + (end - begin) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &r, pack_range(begin, mid))) {
+            atomic_store(&self->range, pack_range(mid, end));
+            return true;
+        }
+    }
+}
+
+void *codegen_worker(void *arg) {
+    Worker *w = arg;
+    int id = w - workers;
+
+    // エラーはgen_rootが文に印を付けてから、ここへ戻ってくる
+    jmp_buf *outer = error_jmp;
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        atomic_store(&codegen_failed, true);
+        error_jmp = outer;
+        return NULL;
+    }
+    error_jmp = &jb;
+
+    for (;;) {
+        int root;
+        while (!atomic_load_explicit(&codegen_failed, memory_order_relaxed) && take_root(w, &root)) {
+            gen_root(root, code[root], &root_outs[root]);
+        }
+        if (atomic_load(&codegen_failed)) {
+            error_jmp = outer;
+            return NULL;
+        }
+
+        bool stolen = false;
+        for (int k = 1; k < worker_count && !stolen; k++) {
+            stolen = steal_roots(w, &workers[(id + k) % worker_count]);
+        }
+        if (!stolen) {
+            error_jmp = outer;
+            return NULL;
+        }
+    }
+}
+
+void gen_roots_parallel(int nthreads) {
+    int n = code_len;
+    if (nthreads > n) {
+        nthreads = n;
+    }
+    worker_count = nthreads;
+    workers = calloc(nthreads, sizeof(Worker));
+    root_outs = calloc(n, sizeof(RootOut));
+    for (int i = 0; i < nthreads; i++) {
+        atomic_init(&workers[i].range, pack_range((long) n * i / nthreads, (long) n * (i + 1) / nthreads));
+    }
+
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, codegen_worker, &workers[i]) != 0) {
+            error("スレッドを作れません");
+        }
+    }
+    codegen_worker(&workers[0]);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    bool failed = false;
+    for (int i = 0; i < n; i++) {
+        failed |= root_outs[i].failed;
+    }
+    if (failed) {
+        // エラーはそのスレッドで表示済み
+        for (int i = 0; i < n; i++) {
+            free(root_outs[i].buf);
+        }
+        free(root_outs);
+        free(workers);
+        error_exit();
+    }
+    for (int i = 0; i < n; i++) {
+        write_root(&root_outs[i]);
+        free(root_outs[i].buf);
+    }
+    free(root_outs);
+    free(workers);
+}
+
+// すべての文のコードを順に出力する
+// -pipelineと、文をcodeに溜めない場合は、構文解析が終わった文から1つずつ生成する
+void gen_roots() {
+    int n = 0;
+    if (codegen_threads > 1 && !stmt_queue) {
+        n = code_len;
+        gen_roots_parallel(codegen_threads);
+    } else {
+        for (Node *node; (node = next_stmt()); n++) {
+            RootOut out;
+            gen_root(n, node, &out);
+            write_root(&out);
+            free(out.buf);
+            if (stream_stmts) {
+                free_tree(node);
+            }
+        }
+    }
+
+    // エピローグは文の外なので、状態を初期化してから出力する
+    begin_root(n, stdout);
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include "header.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio_ext.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// コンパイルからリンク・実行までを行うドライバ
+//   -o FILE : 実行ファイルFILEを作る
+//   -c      : オブジェクトファイルを作る(-oがなければ入力の拡張子を.oにした名前)
+//   -run    : 実行ファイルを作って実行し、その終了ステータスで終了する
+//
+// アセンブリはファイルに書かず、パイプでアセンブラ(as)に流し込む アセンブラはコンパイルと同時に動く
+// 途中のオブジェクトファイルと、-runの実行ファイルはmemfd(名前のないメモリ上のファイル)に置き、
+// 他のプロセスには/proc/<pid>/fd/<fd>として渡す
+// 一時ファイルの名前を使わないので、同じディレクトリで同時に何個動かしてもぶつからない
+// 出力するファイルは<出力先>.tmpに書き、成功してから名前を変える 失敗したときに書きかけのファイルを残さない
+//
+// コンパイル・アセンブル・リンクのエラーは終了せずにdrive()へ戻り、アセンブラを待ってから失敗を返す
+// -runでは実行したプログラムの終了ステータスと区別できるよう、失敗をRUN_FAILED(125)で返す
+
+#define ASSEMBLER "as"
+#define LINKER "gcc"
+#define RUN_FAILED 125  // -runで、プログラムを実行できなかったときの終了ステータス
+
+extern char **environ;
+
+char *output_path;  // -o
+bool opt_compile;   // -c
+bool opt_run;       // -run
+
+// エラーのときに後始末するもの
+int saved_stdout = -1;  // アセンブラにつなぐ前の標準出力
+pid_t as_pid;           // 終了を待っていないアセンブラ
+char *tmp_output;       // 書きかけの出力
+
+// プログラムを起動して終了を待ち、終了ステータスを返す シグナルで終了した場合は128+シグナル番号
+// stdinが-1でなければ、それを標準入力にする
+int spawn_wait(char **argv, int stdin_fd, pid_t *pid_out) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, 0);
+    }
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        error("%sを起動できません: %s", argv[0], strerror(err));
+    }
+    if (pid_out) {
+        // 待つのは呼び出し側
+        *pid_out = pid;
+        return 0;
+    }
+    return wait_status(pid);
+}
+
+int wait_status(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            error("子プロセスを待てません");
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// memfdを他のプロセスから開けるパスにする
+char *fd_path(int fd) {
+    char *buf = malloc(64);
+    snprintf(buf, 64, "/proc/%d/fd/%d", getpid(), fd);
+    return buf;
+}
+
+int new_memfd(char *name) {
+    int fd = memfd_create(name, 0);
+    if (fd < 0) {
+        error("memfdを作れません");
+    }
+    return fd;
+}
+
+// 出力先pathに書く前の一時的な名前
+char *tmp_name(char *path) {
+    char *buf = malloc(strlen(path) + 5);
+    sprintf(buf, "%s.tmp", path);
+    return buf;
+}
+
+// 一時的な名前で書いた出力を、出力先pathにする
+void commit_output(char *path) {
+    if (rename(tmp_output, path) < 0) {
+        error("%sに書き込めません", path);
+    }
+    tmp_output = NULL;
+}
+
+// memfdの内容をファイルに書き出す
+void copy_to_file(int fd, char *path) {
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        error("%sに書き込めません", path);
+    }
+    char buf[65536];
+    long n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            close(out);
+            error("%sに書き込めません", path);
+        }
+    }
+    if (close(out) < 0) {
+        error("%sに書き込めません", path);
+    }
+}
+
+// エラーで戻ってきたときの後始末 標準出力を戻し、アセンブラを止めて待ち、書きかけの出力を消す
+void cleanup_drive() {
+    error_jmp = NULL;
+    if (as_pid) {
+        // 途中までのアセンブリでエラーを出さないよう、入力を閉じる前に止める
+        kill(as_pid, SIGKILL);
+    }
+    if (saved_stdout != -1) {
+        // 出力しかけたアセンブリは捨てる
+        __fpurge(stdout);
+        dup2(saved_stdout, 1);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+    if (as_pid) {
+        wait_status(as_pid);
+        as_pid = 0;
+    }
+    if (tmp_output) {
+        unlink(tmp_output);
+        tmp_output = NULL;
+    }
+}
+
+// -cで-oがないときの出力先 入力の拡張子を.oに変える
+char *object_name(char *path) {
+    if (!path || strcmp(path, "-") == 0) {
+        return "a.o";
+    }
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char *buf = malloc(strlen(base) + 3);
+    strcpy(buf, base);
+    char *dot = strrchr(buf, '.');
+    strcpy(dot && dot != buf ? dot : buf + strlen(buf), ".o");
+    return buf;
+}
+
+// ドライバのオプションを取り除いてからコンパイルし、必要ならアセンブル・リンク・実行する
+int drive(int argc, char **argv) {
+    char **args = calloc(argc + 1, sizeof(char *));
+    int nargs = 0;
+    char *input = NULL;
+    bool opt_watch = false;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && strcmp(argv[i], "-o") == 0) {
+            if (i + 1 == argc) {
+                error("-oの後にファイル名がありません");
+            }
+            output_path = argv[++i];
+        } else if (i > 0 && strcmp(argv[i], "-c") == 0) {
+            opt_compile = true;
+        } else if (i > 0 && strcmp(argv[i], "-run") == 0) {
+            opt_run = true;
+        } else {
+            opt_watch |= strncmp(argv[i], "-watch=", 7) == 0;
+            if (i > 0 && argv[i][0] != '-') {
+                input = argv[i];
+            } else if (i > 0 && strcmp(argv[i], "-") == 0) {
+                input = argv[i];
+            }
+            args[nargs++] = argv[i];
+        }
+    }
+
+    if (!output_path && !opt_compile && !opt_run) {
+        // アセンブリを標準出力に書く
+        return compile(nargs, args);
+    }
+    if (opt_compile && opt_run) {
+        error("-cと-runは同時に指定できません");
+    }
+    if (output_path && opt_run) {
+        // -runは実行ファイルをディスクに書かない
+        error("-oと-runは同時に指定できません");
+    }
+    if (opt_watch) {
+        // -watchは終わらないので、アセンブラに渡す出力が閉じられない
+        error("-watchは-o・-c・-runと同時に指定できません");
+    }
+
+    if (opt_compile && !output_path) {
+        output_path = object_name(input);
+    }
+
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        cleanup_drive();
+        return opt_run ? RUN_FAILED : 1;
+    }
+    error_jmp = &jb;
+
+    // アセンブラを先に起動し、標準出力をそこにつながるパイプに差し替える
+    int obj = new_memfd("obj");
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        error("パイプを作れません");
+    }
+    char *as_argv[] = {ASSEMBLER, "--64", "-o", fd_path(obj), NULL};
+    spawn_wait(as_argv, pipefd[0], &as_pid);
+    close(pipefd[0]);
+
+    fflush(stdout);
+    saved_stdout = dup(1);
+    dup2(pipefd[1], 1);
+    close(pipefd[1]);
+
+    compile(nargs, args);
+
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+    saved_stdout = -1;
+    int status = wait_status(as_pid);
+    as_pid = 0;
+    if (status != 0) {
+        error("アセンブルに失敗しました");
+    }
+
+    if (opt_compile) {
+        tmp_output = tmp_name(output_path);
+        copy_to_file(obj, tmp_output);
+        commit_output(output_path);
+        error_jmp = NULL;
+        return 0;
+    }
+
+    // リンクする -runでは実行ファイルもmemfdに作る
+    int exe = -1;
+    char *exe_path;
+    if (opt_run) {
+        exe = new_memfd("exe");
+        exe_path = fd_path(exe);
+    } else {
+        exe_path = tmp_output = tmp_name(output_path);
+    }
+    char *ld_argv[] = {LINKER, "-o", exe_path, fd_path(obj), NULL};
+    if (spawn_wait(ld_argv, -1, NULL) != 0) {
+        error("リンクに失敗しました");
+    }
+    close(obj);
+
+    if (!opt_run) {
+        commit_output(output_path);
+        error_jmp = NULL;
+        return 0;
+    }
+
+    // 書き込めるファイルディスクリプタが開いていると実行できない(ETXTBSY)ので、読み込み専用で開き直す
+    int ro = open(fd_path(exe), O_RDONLY | O_CLOEXEC);
+    close(exe);
+    if (ro < 0) {
+        error("実行ファイルを開けません");
+    }
+    char *run_argv[] = {fd_path(ro), NULL};
+    // 子プロセスがパスを開くまではroを閉じないよう、CLOEXECを外して引き継ぐ
+    fcntl(ro, F_SETFD, 0);
+    fflush(stdout);
+    fflush(stderr);
+    status = spawn_wait(run_argv, -1, NULL);
+    error_jmp = NULL;
+    return status;
+}
@@ -0,0 +1,229 @@
+#include "header.h"
+
+// アセンブラの出力をまとめて行う
+// ラベルと無条件ジャンプはすぐには出力せず、次の命令が来るまで保留しておく
+// こうすることで、次の2つの無駄を出力する前に取り除ける
+//   jmp .L1      ジャンプ先が直後のラベルなら、ジャンプ自体が不要
+//   .L1:
+//
+//   .L1:         ラベルの直後が無条件ジャンプなら、.L1へのジャンプはすべて.L2に飛ばしてよい
+//   jmp .L2      (ジャンプのスレッディング)
+
+// 文(codeの要素)ごとにコードを生成するので、状態はすべてスレッドごとに持ち、文の始めに初期化する
+// ラベルは文ごとに .L<文の番号>_<文の中での番号> と名前を付けるので、どの順に生成しても同じ出力になる
+
+_Thread_local FILE *asm_out;          // 出力先
+_Thread_local int label_root;         // 生成中の文の番号 ラベルの名前に使う
+_Thread_local int counter;            // 生成中の文の中で、次に作るラベルの番号
+
+_Thread_local int pending_jmp = -1;   // 保留中の無条件ジャンプの飛び先 なければ-1
+_Thread_local int pending_labels[16]; // 保留中のラベル
+_Thread_local int pending_label_count;
+
+_Thread_local int loc_line;           // 次の命令に対応する入力の位置
+_Thread_local int loc_col;
+_Thread_local int loc_emitted[2][2];  // サブセクションごとに、最後に.locで出力した行と列
+
+_Thread_local int subsection;         // 現在出力しているサブセクション 0は通常のコード、1は実行されにくいコード
+_Thread_local bool used_cold;         // 生成中の文がサブセクション1に出力したかどうか
+
+_Thread_local int *label_alias;       // label_alias[l]が-1でなければ、ラベルlはそのラベルの別名
+_Thread_local int label_alias_cap;
+
+// 文rootのコードの出力を始める 出力先はout
+void begin_root(int root, FILE *out) {
+    asm_out = out;
+    label_root = root;
+    counter = 0;
+    pending_jmp = -1;
+    pending_label_count = 0;
+    loc_line = loc_col = 0;
+    memset(loc_emitted, 0, sizeof(loc_emitted));
+    subsection = 0;
+    used_cold = false;
+}
+
+// 文のコードの出力を終える 保留しているジャンプとラベルは次の文に持ち越さない
+void end_root() {
+    flush_pending();
+}
+
+int new_label() {
+    if (counter == label_alias_cap) {
+        label_alias_cap = label_alias_cap ? label_alias_cap * 2 : 64;
+        label_alias = realloc(label_alias, sizeof(int) * label_alias_cap);
+    }
+    label_alias[counter] = -1;
+    return counter++;
+}
+
+// 別名をたどって、実際に定義されるラベルを返す
+int resolve_label(int label) {
+    while (label_alias[label] != -1) {
+        label = label_alias[label];
+    }
+    return label;
+}
+
+// 保留していたジャンプとラベルを出力する
+void flush_pending() {
+    if (pending_jmp != -1) {
+        fprintf(asm_out, "  jmp " ASM_LABEL "%d_%d\n", label_root, pending_jmp);
+        pending_jmp = -1;
+    }
+    for (int i = 0; i < pending_label_count; i++) {
+        fprintf(asm_out, ASM_LABEL "%d_%d:\n", label_root, pending_labels[i]);
+    }
+    pending_label_count = 0;
+}
+
+// 入力の位置が変わっていれば.locとして出力する
+// .locは直後の命令の位置を表すので、保留していたジャンプを出力した後に出す
+// アセンブラは行番号の表をサブセクションごとに作るので、最後に出力した位置もサブセクションごとに覚えておく
+void flush_loc() {
+    int *last = loc_emitted[subsection];
+    if (loc_line != 0 && (loc_line != last[0] || loc_col != last[1])) {
+        fprintf(asm_out, "  " ASM_LOC "%d %d\n", loc_line, loc_col);
+        last[0] = loc_line;
+        last[1] = loc_col;
+    }
+}
+
+// これから出力する命令に対応する入力の位置を設定する
+void emit_loc(int line, int col) {
+    if (line == 0) {
+        return;
+    }
+    loc_line = line;
+    loc_col = col;
+}
+
+// 命令を1つ出力する
+void emit(char *fmt, ...) {
+    flush_pending();
+    flush_loc();
+
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(asm_out, "  ");
+    vfprintf(asm_out, fmt, ap);
+    fprintf(asm_out, "\n");
+    va_end(ap);
+}
+
+void emit_label(int label) {
+    if (pending_jmp == label) {
+        // 直後のラベルへのジャンプは不要
+        pending_jmp = -1;
+    }
+    if (pending_label_count == sizeof(pending_labels) / sizeof(pending_labels[0])) {
+        flush_pending();
+    }
+    pending_labels[pending_label_count++] = label;
+}
+
+void emit_jmp(int label) {
+    label = resolve_label(label);
+
+    // 直前に保留しているラベルは、すべてジャンプ先の別名にできる
+    // ただし自分自身へのジャンプ(空の無限ループ)は別名にできないので残す
+    int kept = 0;
+    for (int i = 0; i < pending_label_count; i++) {
+        int l = pending_labels[i];
+        if (l == label) {
+            pending_labels[kept++] = l;
+            continue;
+        }
+        label_alias[l] = label;
+        fprintf(asm_out, "  .set " ASM_LABEL "%d_%d, " ASM_LABEL "%d_%d\n", label_root, l, label_root, label);
+    }
+    pending_label_count = kept;
+
+    if (pending_label_count == 0 && pending_jmp != -1) {
+        // 無条件ジャンプの直後でラベルもないので、このジャンプには到達しない
+        return;
+    }
+    flush_pending();
+    pending_jmp = label;
+}
+
+// 条件付きジャンプ ccはe, ne, l, leなどの条件コード
+void emit_jcc(char *cc, int label) {
+    flush_pending();
+    flush_loc();
+    fprintf(asm_out, "  j%s " ASM_LABEL "%d_%d\n", cc, label_root, resolve_label(label));
+}
+
+// 出力先のサブセクションを切り替え、切り替える前のサブセクションを返す
+// サブセクション1に出力したコードは、アセンブラによって.textの最後にまとめて配置される
+int emit_subsection(int n) {
+    int prev = subsection;
+    if (n != subsection) {
+        flush_pending();
+        fprintf(asm_out, "  .subsection %d\n", n);
+        subsection = n;
+        used_cold |= n == 1;
+    }
+    return prev;
+}
+
+// 命令以外のディレクティブ(.cfi_*など)を出力する
+void emit_directive(char *fmt, ...) {
+    flush_pending();
+
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(asm_out, "  ");
+    vfprintf(asm_out, fmt, ap);
+    fprintf(asm_out, "\n");
+    va_end(ap);
+}
+
+static bool has_prefix(char *p, char *end, char *s) {
+    int len = strlen(s);
+    return end - p >= len && memcmp(p, s, len) == 0;
+}
+
+// 文のアセンブリbufを、生成したときの状態に依存する数をfixで直しながらoutに書き出す
+// ここで探す形はASM_*の形で出力しているものに限るので、出力の形を変えるときはASM_*も合わせて変える
+// ASM_LABELは、後ろに数字と'_'が続くもの(文のラベル)だけを書き換える
+void relocate_asm(FILE *out, char *buf, size_t len, long (*fix)(RelocKind kind, long val, void *arg), void *arg) {
+    static struct {
+        char *prefix;
+        RelocKind kind;
+    } pats[] = {
+        {ASM_LABEL, RELOC_ROOT},
+        {ASM_LOC, RELOC_LINE},
+        {ASM_VAR, RELOC_VAR},
+        {ASM_COUNTER, RELOC_COUNTER},
+    };
+
+    char *p = buf;
+    char *end = buf + len;
+    char *copied = p;   // ここまではoutに書き出した
+    while (p < end) {
+        int i = 0;
+        while (i < 4 && !has_prefix(p, end, pats[i].prefix)) {
+            i++;
+        }
+        if (i == 4) {
+            p++;
+            continue;
+        }
+        char *num = p + strlen(pats[i].prefix);
+        if (num == end || !isdigit(*num)) {
+            p++;
+            continue;
+        }
+        char *q;
+        long val = strtol(num, &q, 10);
+        if (pats[i].kind == RELOC_ROOT && *q != '_') {
+            p++;
+            continue;
+        }
+        fwrite(copied, 1, num - copied, out);
+        fprintf(out, "%ld", fix(pats[i].kind, val, arg));
+        p = copied = q;
+    }
+    fwrite(copied, 1, end - copied, out);
+}
@@ -25,98 +25,704 @@ void dump_node_type(Node *node) {
     return;
 }
 
-//ノードを右辺値として評価する
-//tokenを読みながら構文木を構築し、nodeの左右の子の値をスタックにpushし、nodeを根とする部分木の値を計算し、raxに格納するアセンブラを出力する
+// xが2の冪ならその指数を、そうでなければ-1を返す
+int log2_exact(long x) {
+    if (x <= 0 || (x & (x - 1)) != 0) {
+        return -1;
+    }
+    int k = 0;
+    while ((1L << k) != x) {
+        k++;
+    }
+    return k;
+}
+
+// 符号付き64ビット除算 n / d (d >= 3、2の冪ではない) を
+// 乗算の上位64ビットとシフトで計算するためのマジックナンバーを求める
+// Hacker's Delight 10-1節のアルゴリズムをそのまま64ビットにしたもの
+void signed_magic(long d, long *magic, int *shift) {
+    const unsigned long two63 = 1UL << 63;
+    unsigned long ad = d;
+    unsigned long anc = two63 - 1 - two63 % ad;
+    int p = 63;
+    unsigned long q1 = two63 / anc;
+    unsigned long r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / ad;
+    unsigned long r2 = two63 - q2 * ad;
+    unsigned long delta;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (long) (q2 + 1);
+    *shift = p - 64;
+}
+
+// raxの値に定数immを掛けるアセンブラを出力する
+// imulは3サイクルかかるので、シフトとleaで済む場合はそちらを使う
+void gen_mul_imm(long imm) {
+    if (imm < 0) {
+        gen_mul_imm(-imm);
+        emit("neg rax");
+        return;
+    }
+    if (imm == 0) {
+        emit("xor eax, eax");
+        return;
+    }
+
+    // imm = m * 2^k (m = 1, 3, 5, 9) ならlea 1回とシフト1回で済む
+    int k = 0;
+    long m = imm;
+    while ((m & 1) == 0) {
+        m >>= 1;
+        k++;
+    }
+    if (m == 1 || m == 3 || m == 5 || m == 9) {
+        if (m != 1) {
+            emit("lea rax, [rax+rax*%ld]", m - 1);
+        }
+        if (k > 0) {
+            emit("shl rax, %d", k);
+        }
+        return;
+    }
+
+    // imm = 2^k ± 1 ならシフトと加減算で済む
+    k = log2_exact(imm - 1);
+    if (k > 0) {
+        emit("mov rdi, rax");
+        emit("shl rax, %d", k);
+        emit("add rax, rdi");
+        return;
+    }
+    k = log2_exact(imm + 1);
+    if (k > 0 && k < 63) {
+        emit("mov rdi, rax");
+        emit("shl rax, %d", k);
+        emit("sub rax, rdi");
+        return;
+    }
+
+    emit("imul rax, rax, %ld", imm);
+}
+
+// raxの値を正の定数immで割った商(0方向への切り捨て)をraxに格納するアセンブラを出力する
+// idivは数十サイクルかかるので、シフトまたはマジックナンバーとの乗算で代用する
+// 単項の-は0からの引き算になるので、ND_NUMの値は負にならない(桁あふれした数はidivで割る)
+void gen_div_imm(long imm) {
+    if (imm == 1) {
+        return;
+    }
+
+    int k = log2_exact(imm);
+    if (k > 0) {
+        // 算術右シフトは負の方向に丸めるので、負の数には先に2^k-1を足しておく
+        emit("mov rdi, rax");
+        emit("sar rdi, 63");
+        emit("shr rdi, %d", 64 - k);
+        emit("add rax, rdi");
+        emit("sar rax, %d", k);
+        return;
+    }
+
+    long magic;
+    int shift;
+    signed_magic(imm, &magic, &shift);
+
+    // imulは1オペランドの場合rdx:raxに128ビットの積を格納する
+    emit("mov rdi, rax");
+    emit("mov rax, %ld", magic);
+    emit("imul rdi");
+    if (magic < 0) {
+        emit("add rdx, rdi");
+    }
+    if (shift > 0) {
+        emit("sar rdx, %d", shift);
+    }
+    // rdxは負の方向に丸めた商なので、商が負(符号ビットが1)のときは1を足して0方向に丸める
+    emit("mov rax, rdx");
+    emit("shr rax, 63");
+    emit("add rax, rdx");
+}
+// 木が代入(副作用)を含むかどうか
+// 含まない部分木は評価順序を入れ替えても結果が変わらない
+bool has_side_effect(Node *node) {
+    if (node == NULL) {
+        return false;
+    }
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+        case ND_BLANK:
+            return false;
+        case ND_ADD:
+        case ND_SUB:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return has_side_effect(node->lhs) || has_side_effect(node->rhs);
+        default:
+            return true;
+    }
+}
+
+// 命令のオペランドに直接書けるノード(即値かメモリ)かどうか
+bool is_operand(Node *node) {
+    return node->kind == ND_NUM || node->kind == ND_LVAR;
+}
+
+// ノードをオペランドの文字列に変換する
+// 1つの命令で2つまで使えるように、バッファを交互に使う
+char *operand(Node *node) {
+    static _Thread_local char buf[2][32];
+    static _Thread_local int turn;
+    char *s = buf[turn];
+    turn ^= 1;
+
+    if (node->kind == ND_NUM) {
+        snprintf(s, 32, "%d", node->val);
+    } else {
+        snprintf(s, 32, "%s", gen_lval(node));
+    }
+    return s;
+}
+
+// 二項演算子ごとの命令
+// 比較演算子はcmpの後に条件コードccでsetccや条件付きジャンプを行う
+typedef struct {
+    NodeKind kind;
+    char *insn;    // 演算命令 比較演算子ならNULL
+    char *cc;      // 比較演算子の条件コード
+    char *swapped; // 左右を入れ替えたときの条件コード
+    bool commutative;
+} BinOp;
+
+BinOp binops[] = {
+    {ND_ADD, "add", NULL, NULL, true},
+    {ND_SUB, "sub", NULL, NULL, false},
+    {ND_MUL, "imul", NULL, NULL, true},
+    {ND_DIV, "idiv", NULL, NULL, false},
+    {ND_EQ, NULL, "e", "e", true},
+    {ND_NE, NULL, "ne", "ne", true},
+    {ND_LT, NULL, "l", "g", true},
+    {ND_LE, NULL, "le", "ge", true},
+};
+
+BinOp *find_binop(NodeKind kind) {
+    for (int i = 0; i < sizeof(binops) / sizeof(binops[0]); i++) {
+        if (binops[i].kind == kind) {
+            return &binops[i];
+        }
+    }
+    return NULL;
+}
+
+// 条件コードの否定を返す
+char *negate_cc(char *cc) {
+    static char *table[][2] = {
+        {"e", "ne"}, {"ne", "e"},
+        {"l", "ge"}, {"ge", "l"},
+        {"le", "g"}, {"g", "le"},
+    };
+    for (int i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (strcmp(table[i][0], cc) == 0) {
+            return table[i][1];
+        }
+    }
+    error("不明な条件コードです: %s", cc);
+    return NULL;
+}
+
+// 二項演算の左辺をraxに評価し、右辺をオペランドとして返す
+// 左右を入れ替えて評価した場合は*swappedを真にし、*rhsには右辺として使ったノードを入れる
+// 右辺がレジスタ(rdi)に入った場合は*rhsをNULLにする
+char *gen_operands(Node *node, Node **rhs, bool *swapped) {
+    BinOp *op = find_binop(node->kind);
+    *swapped = false;
+
+    // 右辺が即値か変数なら、左辺だけ評価して右辺はオペランドとして使う
+    // 左辺が即値で可換な演算の場合は、入れ替えて即値の方をオペランドにする
+    if (is_operand(node->rhs) && !(op->commutative && node->lhs->kind == ND_NUM)) {
+        gen(node->lhs);
+        *rhs = node->rhs;
+        return operand(node->rhs);
+    }
+
+    // 左辺が即値か変数なら、可換な演算では左右を入れ替えられる
+    // ただし右辺が左辺の変数に代入する場合は評価順序が変わってしまうので入れ替えない
+    if (op->commutative && is_operand(node->lhs) &&
+        (node->lhs->kind == ND_NUM || !has_side_effect(node->rhs))) {
+        gen(node->rhs);
+        *rhs = node->lhs;
+        *swapped = true;
+        return operand(node->lhs);
+    }
+
+    // 一般の場合は左辺の値をスタックに退避してから右辺を評価する
+    gen(node->lhs);
+    emit("push rax");
+    gen(node->rhs);
+    emit("mov rdi, rax");
+    emit("pop rax");
+    *rhs = NULL;
+    return "rdi";
+}
+
+// raxとsrcを比較してフラグをセットする
+void gen_cmp(char *src) {
+    if (strcmp(src, "0") == 0) {
+        emit("test rax, rax");
+    } else {
+        emit("cmp rax, %s", src);
+    }
+}
+
+// rax(左辺)とsrc(右辺)に二項演算を施し、結果をraxに格納する
+// srcはレジスタ・メモリ・即値のいずれか
+// swappedが真のときは、左右を入れ替えて評価したことを表す
+void gen_binop(BinOp *op, Node *rhs, char *src, bool swapped) {
+    if (op->cc) {
+        gen_cmp(src);
+        emit("set%s al", swapped ? op->swapped : op->cc);
+        emit("movzb rax, al");
+        return;
+    }
+
+    switch (op->kind) {
+        case ND_MUL:
+            if (rhs && rhs->kind == ND_NUM) {
+                gen_mul_imm(rhs->val);
+                return;
+            }
+            break;
+        case ND_DIV:
+            // idivは即値を取れないので、0や桁あふれして負になった定数はレジスタに入れてから割る
+            if (rhs && rhs->kind == ND_NUM && rhs->val > 0) {
+                gen_div_imm(rhs->val);
+                return;
+            }
+            if (rhs && rhs->kind == ND_NUM) {
+                emit("mov rdi, %s", src);
+                src = "rdi";
+            }
+            // cqoはraxの値を128ビットに拡張し、上位をrdx、下位をraxに格納する
+            // idivはrdxとraxを合わせて128ビット整数とみなして、
+            // 引数で割った値の商をraxに、余りをrdxにセットする
+            emit("cqo");
+            emit("idiv %s", src);
+            return;
+        default:
+            break;
+    }
+    emit("%s rax, %s", op->insn, src);
+}
+
+// 何もしない文かどうか
+bool is_empty_stmt(Node *node) {
+    if (node->kind == ND_BLANK) {
+        return true;
+    }
+    if (node->kind != ND_BLOCK) {
+        return false;
+    }
+    for (cell *cur = node->compound.head; cur; cur = cur->next) {
+        if (!is_empty_stmt(cur->stmt)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 条件式condの真偽がjump_ifと一致するときlabelにジャンプし、そうでなければ次の命令に進む
+// 比較演算子の場合は真偽値を作らず、cmpの結果のフラグで直接分岐する
+void gen_cond(Node *cond, bool jump_if, int label) {
+    if (cond->kind == ND_NUM) {
+        if ((cond->val != 0) == jump_if) {
+            emit_jmp(label);
+        }
+        return;
+    }
+
+    BinOp *op = find_binop(cond->kind);
+    if (op && op->cc) {
+        Node *rhs;
+        bool swapped;
+        char *src = gen_operands(cond, &rhs, &swapped);
+        gen_cmp(src);
+        char *cc = swapped ? op->swapped : op->cc;
+        emit_jcc(jump_if ? cc : negate_cc(cc), label);
+        return;
+    }
+
+    gen(cond);
+    emit("test rax, rax");
+    emit_jcc(jump_if ? "ne" : "e", label);
+}
+
+// if文の節が「変数 = 式」1つだけなら、その代入のノードを返す
+// 空の節ならblank_node()を、それ以外ならNULLを返す
+Node *single_assign(Node *node) {
+    if (is_empty_stmt(node)) {
+        return blank_node();
+    }
+    if (node->kind == ND_BLOCK) {
+        Node *found = NULL;
+        for (cell *cur = node->compound.head; cur; cur = cur->next) {
+            if (is_empty_stmt(cur->stmt)) {
+                continue;
+            }
+            if (found) {
+                return NULL;
+            }
+            found = cur->stmt;
+        }
+        return single_assign(found);
+    }
+    if (node->kind == ND_ASSIGN && node->lhs->kind == ND_LVAR) {
+        return node;
+    }
+    return NULL;
+}
+
+// 両方の節を実行したときのおおよそのコスト
+// 副作用がある、または0除算で例外が起きうる式は、分岐なしで評価できないので-1を返す
+int ifconv_cost(Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            return 1;
+        case ND_ADD:
+        case ND_SUB:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+        case ND_MUL:
+        case ND_DIV: {
+            if (node->kind == ND_DIV && (node->rhs->kind != ND_NUM || node->rhs->val == 0)) {
+                return -1;
+            }
+            int l = ifconv_cost(node->lhs);
+            int r = ifconv_cost(node->rhs);
+            if (l < 0 || r < 0) {
+                return -1;
+            }
+            return l + r + (node->kind == ND_MUL || node->kind == ND_DIV ? 3 : 1);
+        }
+        default:
+            return -1;
+    }
+}
+
+// 分岐予測に失敗すると15から20サイクルほど失うので、
+// 両方の節を合わせてこれより安く計算できるなら、分岐せずに両方計算してcmovで選ぶ
+#define IFCONV_MAX_COST 12
+
+// どちらかの節の実行回数が、もう一方のこの割合以下なら、実行されにくい節とみなす
+// そのような分岐は予測が当たるのでif変換せず、実行されにくい節はコードの外に追い出す
+#define COLD_RATIO 8
+
+// if (A) x = B; else x = C; を分岐なしのcmovで出力する(if変換)
+// 変換できない、または分岐した方が速いと判断した場合はfalseを返す
+bool gen_ifconv(Node *node) {
+    // 実行回数を数えるときは、それぞれの節を分岐で実行する必要がある
+    if (no_if_conversion || profile_generate) {
+        return false;
+    }
+
+    Node *then = single_assign(node->if_true);
+    Node *els = single_assign(node->if_false);
+    if (!then || !els || (then->kind == ND_BLANK && els->kind == ND_BLANK)) {
+        return false;
+    }
+
+    // 空の節は x = x とみなす
+    Node *var = then->kind == ND_ASSIGN ? then->lhs : els->lhs;
+    Node *then_val = then->kind == ND_ASSIGN ? then->rhs : var;
+    Node *else_val = els->kind == ND_ASSIGN ? els->rhs : var;
+    if (then->kind == ND_ASSIGN && els->kind == ND_ASSIGN && then->lhs->offset != els->lhs->offset) {
+        return false;
+    }
+
+    int cond_cost = ifconv_cost(node->if_cond);
+    int then_cost = ifconv_cost(then_val);
+    int else_cost = ifconv_cost(else_val);
+    if (cond_cost < 0 || then_cost < 0 || else_cost < 0 || then_cost + else_cost > IFCONV_MAX_COST) {
+        return false;
+    }
+
+    // 片方の節に大きく偏っている分岐は予測が当たるので、分岐のままの方が速い
+    long t = prof_count_of(node->prof_id);
+    long f = prof_count_of(node->prof_id + 1);
+    if (t >= 0 && (t * COLD_RATIO <= f || f * COLD_RATIO <= t)) {
+        return false;
+    }
+
+    // 両方の節の値を先に計算してスタックに退避しておく
+    // 変数ならcmovのオペランドに直接書けるので、退避しない
+    if (then_val->kind != ND_LVAR) {
+        gen(then_val);
+        emit("push rax");
+    }
+    gen(else_val);
+    emit("push rax");
+
+    // 条件式でフラグをセットする
+    char *cc = "ne";
+    BinOp *op = find_binop(node->if_cond->kind);
+    if (op && op->cc) {
+        Node *rhs;
+        bool swapped;
+        gen_cmp(gen_operands(node->if_cond, &rhs, &swapped));
+        cc = swapped ? op->swapped : op->cc;
+    } else {
+        gen(node->if_cond);
+        emit("test rax, rax");
+    }
+
+    // popとmovはフラグを変えないので、cmpの結果のまま選べる
+    emit("pop rax");
+    if (then_val->kind == ND_LVAR) {
+        emit("cmov%s rax, %s", cc, gen_lval(then_val));
+    } else {
+        emit("pop rdi");
+        emit("cmov%s rax, rdi", cc);
+    }
+    emit("mov %s, rax", gen_lval(var));
+    return true;
+}
+
+// 実行されにくいコードをサブセクション1に出力し始める 戻り値はgen_cold_endに渡す
+// サブセクション1はmainの範囲の外に置かれるので、CFIは別の関数(main.cold)として付ける
+// フレームはmainと同じくrbpを基準にしている
+int gen_cold_begin() {
+    int prev = emit_subsection(1);
+    if (prev == 0) {
+        emit_directive(".cfi_startproc simple");
+        emit_directive(".cfi_def_cfa rbp, 16");
+        emit_directive(".cfi_offset rbp, -16");
+        emit_directive(".cfi_offset rip, -8");
+    }
+    return prev;
+}
+
+void gen_cold_end(int prev) {
+    if (prev == 0) {
+        emit_directive(".cfi_endproc");
+    }
+    emit_subsection(prev);
+}
+
+// if文の節を出力する 実行回数を数える場合は、節の先頭でカウンタを増やす
+void gen_arm(Node *arm, int prof_id) {
+    emit_counter(prof_id);
+    gen(arm);
+}
+
+// if文を出力する
+// プロファイルがあれば、よく実行される節を分岐しない側(fall-through)に置き、
+// ほとんど実行されない節はサブセクション1に追い出す
+void gen_if(Node *node) {
+    if (node->if_cond->kind == ND_NUM) {
+        // 条件が定数なら、実行される方の節だけを出力する
+        gen(node->if_cond->val ? node->if_true : node->if_false);
+        return;
+    }
+    if (gen_ifconv(node)) {
+        // 分岐なしで出力できた
+        return;
+    }
+
+    bool then_first = true;
+    bool out_of_line = false;
+    long t = prof_count_of(node->prof_id);
+    long f = prof_count_of(node->prof_id + 1);
+    if (t >= 0) {
+        then_first = t >= f;
+        long hot = then_first ? t : f;
+        long cold = then_first ? f : t;
+        out_of_line = hot > 0 && cold * COLD_RATIO <= hot;
+    }
+
+    // firstは条件がfirst_ifのときに実行される節で、分岐せずにそのまま実行する
+    Node *first = then_first ? node->if_true : node->if_false;
+    Node *second = then_first ? node->if_false : node->if_true;
+    int first_id = node->prof_id + (then_first ? 0 : 1);
+    int second_id = node->prof_id + (then_first ? 1 : 0);
+    bool first_if = then_first;
+
+    // 空の節にはジャンプを出力しない
+    // ただし実行回数を数える場合は、空の節にもカウンタを置く
+    bool first_empty = !profile_generate && is_empty_stmt(first);
+    bool second_empty = !profile_generate && is_empty_stmt(second);
+    int end = new_label();
+
+    if (first_empty && second_empty) {
+        if (has_side_effect(node->if_cond)) {
+            gen(node->if_cond);
+        }
+    } else if (second_empty) {
+        gen_cond(node->if_cond, !first_if, end);
+        gen_arm(first, first_id);
+    } else if (out_of_line) {
+        int cold = new_label();
+        gen_cond(node->if_cond, !first_if, cold);
+        gen_arm(first, first_id);
+        emit_label(end);
+
+        int prev = gen_cold_begin();
+        emit_label(cold);
+        gen_arm(second, second_id);
+        emit_jmp(end);
+        gen_cold_end(prev);
+        return;
+    } else if (first_empty) {
+        gen_cond(node->if_cond, first_if, end);
+        gen_arm(second, second_id);
+    } else {
+        int other = new_label();
+        gen_cond(node->if_cond, !first_if, other);
+        gen_arm(first, first_id);
+        emit_jmp(end);
+        emit_label(other);
+        gen_arm(second, second_id);
+    }
+    emit_label(end);
+}
+
+// ループの回転を行った後の本体を出力する
+// unroll回分の本体を並べ、間に脱出の判定を挟む(ループの展開)
+// begin:
+//       本体
+//       if (!cond) goto end   ← unroll > 1 のときのみ
+//       本体
+//       if (cond) goto begin
+void gen_loop_body(Node *node, Node *cond, Node *body, Node *upd, int begin, int end, int unroll) {
+    emit_label(begin);
+    for (int i = 0; i < unroll; i++) {
+        if (i > 0 && cond->kind != ND_BLANK) {
+            gen_cond(cond, false, end);
+        }
+        emit_counter(node->prof_id + 1);
+        gen(body);
+        if (upd) {
+            gen(upd);
+        }
+    }
+    if (cond->kind == ND_BLANK) {
+        emit_jmp(begin);
+    } else {
+        gen_cond(cond, true, begin);
+    }
+}
+
+// ループ本体(for文の場合は更新式を含む)と条件式から、ループを出力する
+// 条件判定をループの末尾に置き(ループの回転)、1周ごとの無条件ジャンプをなくす
+// 最初の1回だけは、先頭で条件を確かめてからループに入る
+//       if (!cond) goto end
+// begin:
+//       本体
+//       if (cond) goto begin
+// end:
+// プロファイルがあれば、平均の反復回数が多いループは展開し、
+// 一度も本体が実行されなかったループはサブセクション1に追い出す
+void gen_loop(Node *node, Node *cond, Node *body, Node *upd) {
+    // 条件が常に偽なら、本体は実行されない
+    if (cond->kind == ND_NUM && cond->val == 0) {
+        return;
+    }
+    emit_counter(node->prof_id);
+
+    int unroll = 1;
+    bool out_of_line = false;
+    long entries = prof_count_of(node->prof_id);
+    long iters = prof_count_of(node->prof_id + 1);
+    if (entries > 0) {
+        long trips = iters / entries;
+        unroll = trips >= 64 ? 4 : trips >= 16 ? 2 : 1;
+        out_of_line = iters == 0 && cond->kind != ND_BLANK;
+    }
+
+    int begin = new_label();
+    int end = new_label();
+
+    if (out_of_line) {
+        gen_cond(cond, true, begin);
+        emit_label(end);
+        int prev = gen_cold_begin();
+        gen_loop_body(node, cond, body, upd, begin, end, 1);
+        emit_jmp(end);
+        gen_cold_end(prev);
+        return;
+    }
+
+    if (cond->kind != ND_BLANK) {
+        gen_cond(cond, false, end);
+    }
+    gen_loop_body(node, cond, body, upd, begin, end, unroll);
+    emit_label(end);
+}
+
+//ノードを右辺値として評価し、その値をraxに格納するアセンブラを出力する
+//子が即値や変数であれば、スタックを経由せずに命令のオペランドとして直接使う
 void gen(Node *node) {
+    emit_loc(node->line, node->col);
+
     switch (node->kind) {
         case ND_NUM: {
-            printf("  push %d\n", node->val);
+            emit("mov rax, %d", node->val);
             return;
         }
         case ND_LVAR: {
-            gen_lval(node);
-            //この時点でスタックトップには変数のアドレスが入っている
-            printf("  pop rax\n");
-            //下の命令は「raxの値をアドレスとみなしてそこから値をロードしraxに保存する」
-            printf("  mov rax, [rax]\n");
-            printf("  push rax\n");
+            emit("mov rax, %s", gen_lval(node));
             return;
         }
         case ND_ASSIGN: {
-            //ノードの左の子(変数名)を左辺値として評価する
-            //スタックトップにはraxの値(変数のアドレス)が入る
-            gen_lval(node->lhs);
-            //右の子を右辺値として評価する
-            //スタックトップにはraxの値(評価後の値)が入る
+            //右辺を評価した値を、左辺の変数のアドレスに直接書き込む
+            //代入式の値として、raxには右辺の値が残る
             gen(node->rhs);
-
-            printf("  pop rdi\n");
-            printf("  pop rax\n");
-            //raxに格納されているアドレスにrdiの値を代入する(raxには代入しない)
-            printf("  mov [rax], rdi\n");
-            printf("  push rdi\n");
+            emit("mov %s, rax", gen_lval(node->lhs));
             return;
         }
         case ND_RETURN: {
             gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  mov rsp, rbp\n");
-            printf("  pop rbp\n");
-            printf("  ret\n");
+            emit_loc(node->line, node->col);
+            gen_epilogue();
             return;
         }
 
         case ND_IF: {
             // if (A) B else C
-            // Aをコンパイル
-            gen(node->if_cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            int tmp_if = counter;
-            counter += 2;
-            printf("  je  .L%d\n", tmp_if);
-            // Bをコンパイル
-            gen(node->if_true);
-            printf("  jmp .L%d\n", tmp_if + 1);
-            printf(".L%d:\n", tmp_if);
-            gen(node->if_false);
-            printf(".L%d:\n", tmp_if + 1);
+            gen_if(node);
             return;
         }
         case ND_WHILE: {
             // while(A) B
-            int tmp_while = counter;
-            counter += 2;
-            printf(".L%d:\n", tmp_while);
-            // Aをコンパイル
-            gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je .L%d\n", tmp_while + 1);
-            // Bをコンパイル
-            gen(node->rhs);
-            printf("  jmp .L%d\n", tmp_while);
-            printf(".L%d:\n", tmp_while + 1);
+            gen_loop(node, node->lhs, node->rhs, NULL);
             return;
         }
         case ND_FOR: {
             // for (A; B; C) D
-            int tmp_for = counter;
-            counter += 2;
-            // Aをコンパイル
             gen(node->for_init);
-            printf(".L%d:\n", tmp_for);
-            // Bをコンパイル
-            gen(node->for_cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .L%d\n", tmp_for + 1);
-            // Dをコンパイル
-            gen(node->for_content);
-            // Cをコンパイル
-            gen(node->for_upd);
-            printf("  jmp .L%d\n", tmp_for);
-            printf(".L%d:\n", tmp_for + 1);
+            gen_loop(node, node->for_cond, node->for_content, node->for_upd);
             return;
         }
         case ND_BLOCK:{
@@ -124,7 +730,6 @@ void gen(Node *node) {
             while(cur != NULL){
                 gen(cur->stmt);
                 cur = cur->next;
-                printf("  pop rax\n");
             }
             return;
         }
@@ -133,73 +738,60 @@ void gen(Node *node) {
         }
     }
 
+    Node *rhs;
+    bool swapped;
+    char *src = gen_operands(node, &rhs, &swapped);
+    gen_binop(find_binop(node->kind), rhs, src, swapped);
+}
 
-    gen(node->lhs);
-    gen(node->rhs);
-
-    // 演算子の両辺の値をpopしてrdiとraxに格納する
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
-
+//ノードを左辺値として評価し、変数のアドレスを表すメモリオペランドを返す
+//変数はベースポインタからオフセットの分だけ下のアドレスに割り当てられている
+char *gen_lval(Node *node) {
+    static _Thread_local char buf[32];
 
-    switch (node->kind) {
-        case ND_ADD:
-            printf("  add rax, rdi\n");
-            break;
-        case ND_SUB:
-            printf("  sub rax, rdi\n");
-            break;
-        case ND_MUL:
-            printf("  imul rax, rdi\n");
-            break;
-        case ND_DIV:
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
-            // cqoはraxの値を128ビットに拡張し、上(0000)をrdx、下(rax)をraxに格納する
-            // idivはrdxとraxを合わせて128ビット整数とみなして、
-            // 引数(今回はrdi)で割った値の商をraxに、余りをrdxにセットする
-            break;
-        case ND_EQ:
-            // cmpは2つの引数の比較結果をフラグレジスタという特別なレジスタに格納する
-            // seteは直前のcmpで調べた2つのレジスタの値が同じだったときに引数のレジスタに1を、異なっていたら0をセットする
-            // alはraxの下位ビットの別名(seteは8ビットレジスタしか引数に取れない)
-            // movzbによって、raxの上位56ビットをゼロクリアする
-            printf("  cmp rax, rdi\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_NE:
-            printf("  cmp rax, rdi\n");
-            printf("  setne al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_LT:
-            printf("  cmp rax, rdi\n");
-            printf("  setl al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_LE:
-            printf("  cmp rax, rdi\n");
-            printf("  setle al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_NUM:
-            break;
+    if(node->kind != ND_LVAR){
+        error("代入の左辺値が変数ではありません");
     }
 
-    printf("  push rax\n");
+    snprintf(buf, sizeof(buf), "QWORD PTR " ASM_VAR "%d]", node->offset);
+    return buf;
 }
 
-//ノードを左辺値として評価する
-void gen_lval(Node *node) {
-    if(node->kind != ND_LVAR){
-        error("代入の左辺値が変数ではありません");
+//関数の先頭を出力する
+//perfやgdbが入力の行とスタックフレームをたどれるように、.file/.locとCFIを付ける
+void gen_prologue(char *path) {
+    asm_out = stdout;
+    printf(".intel_syntax noprefix\n");
+    printf(".file 1 \"");
+    for (char *p = path; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            printf("\\");
+        }
+        printf("%c", *p);
     }
+    printf("\"\n");
+    printf(".text\n");
+    printf(".globl main\n");
+    printf(".type main, @function\n");
+    printf("main:\n");
 
-    //ベースアドレスの番地をraxに代入
-    printf("  mov rax, rbp\n");
-    //オフセットの分だけraxの値を減らす(そのアドレスに変数が割り当てられる)
-    printf("  sub rax, %d\n", node->offset);
-    //スタックにraxに書いてあるアドレスを代入する
-    printf("  push rax\n");
-}
\ No newline at end of file
+    emit_directive(".cfi_startproc");
+    emit("push rbp");
+    emit_directive(".cfi_def_cfa_offset 16");
+    emit_directive(".cfi_offset rbp, -16");
+    emit("mov rbp, rsp");
+    emit_directive(".cfi_def_cfa_register rbp");
+    emit("sub rsp, 208");
+}
+
+//関数から戻るコードを出力する return文からも呼ばれるので、
+//戻った後に続くコードのためにCFIの状態を元に戻しておく
+void gen_epilogue() {
+    emit_profile_dump();
+    emit_directive(".cfi_remember_state");
+    emit("mov rsp, rbp");
+    emit("pop rbp");
+    emit_directive(".cfi_def_cfa rsp, 8");
+    emit("ret");
+    emit_directive(".cfi_restore_state");
+}
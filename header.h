@@ -5,13 +5,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 char *read_file(char *path);
 
+char *read_stream(int fd);
+
 void error(char *fmt, ...);
 
 void error_at(char *loc, char *fmt, ...);
 
+void error_exit();
+
+extern _Thread_local jmp_buf *error_jmp; //設定されていれば、エラーのときに終了せずにここへ戻る スレッドごとに持つ
+
 char *user_input;
 
 bool consume(char *op);
@@ -56,11 +65,12 @@ typedef struct Token Token;
 
 struct Token {
     TokenKind kind;
-    Token *next;
     int val;
     char *str;
     int len;
     int id; //何番目のトークンか
+    int line; //入力の何行目にあるか(1始まり)
+    int col;  //行の何文字目にあるか(1始まり)
 };
 
 Token *consume_ident();
@@ -76,16 +86,41 @@ bool consume_while();
 bool consume_for();
 
 
-//このグローバル変数に、入力をトークナイズした列を格納する
+//このグローバル変数に、構文解析中の現在のトークンを格納する
 Token *token;
 int token_count;
+extern _Thread_local int token_line;         //トークナイズ中の行番号
+extern _Thread_local char *token_line_start; //トークナイズ中の行の先頭
 int parse_count;
-
-Token *new_token(TokenKind kind, Token *cur, char *str, int len);
+char *token_pos;        //次にトークナイズする入力の位置
 
 bool startswith(char *p, char *q);
 
-Token *tokenize(char *p);
+char *lex_token(char *p, Token *tok);
+
+void log_token(Token *tok);
+
+void tokenize_parallel(char *p, int nthreads);
+
+bool take_token(Token *tok);
+
+bool read_token(Token *tok);
+
+void init_tokenizer(char *p);
+
+Token *next_token();
+
+void dump_tokens();
+
+void count_tokens();
+
+void init_scanner(char *mode);
+
+char *skip_space(char *p);
+
+char *skip_ident(char *p);
+
+char *skip_digit(char *p);
 
 LVar *find_lvar(Token *tok);
 
@@ -142,6 +177,10 @@ struct Node {
     vector compound;  // kindがND_BLOCKの場合のみ
     int val;      // kindがND_NUMの場合のみ
     int offset;   // kindがND_LVARの場合のみ　ベースポインタからのオフセット
+    int prof_id;  // kindがND_IF, ND_WHILE, ND_FORの場合のみ プロファイルのカウンタの番号
+
+    int line;     // ノードに対応する入力の位置 デバッグ情報(.loc)に使う
+    int col;
 };
 
 Node *new_node(NodeKind kind, Node *lhs, Node *rhs);
@@ -150,32 +189,228 @@ Node *blank_node();
 
 Node *new_node_num(int val);
 
+void set_pos(Node *node, Token *tok);
+
 void program();
 
+void push_code(Node *node);
+
+void free_tree(Node *node);
+
 Node *stmt();
 
 Node *expr();
 
-Node *assign();
+Node *primary();
 
-Node *equality();
+char *gen_lval(Node *node);
 
-Node *relation();
+void gen_prologue(char *path);
 
-Node *add();
+void gen_epilogue();
 
-Node *mul();
+int log2_exact(long x);
 
-Node *unary();
+void signed_magic(long d, long *magic, int *shift);
 
-Node *primary();
+void gen_mul_imm(long imm);
 
-void gen_lval(Node *node);
+void gen_div_imm(long imm);
 
 void gen(Node *node);
 
-Node *code[100];
+bool has_side_effect(Node *node);
+
+char *negate_cc(char *cc);
+
+char *gen_operands(Node *node, Node **rhs, bool *swapped);
+
+void gen_cmp(char *src);
+
+bool is_empty_stmt(Node *node);
+
+void gen_cond(Node *cond, bool jump_if, int label);
+
+Node *single_assign(Node *node);
+
+int ifconv_cost(Node *node);
+
+bool gen_ifconv(Node *node);
+
+bool cold_started; //main.coldを出力したかどうか 文のコードを書き出すときに決める
+
+int gen_cold_begin();
+
+void gen_cold_end(int prev);
+
+void gen_if(Node *node);
+
+void gen_loop(Node *node, Node *cond, Node *body, Node *upd);
+
+bool is_operand(Node *node);
+
+char *operand(Node *node);
+
+//構文解析した文の根を順に格納する 最後の要素の次はNULL
+Node **code;
+int code_len;
+int code_cap;
+
+//コマンドラインオプション
+bool no_if_conversion; // -fno-if-conversion if変換(cmovによる分岐の除去)を行わない
+char *profile_generate; // -fprofile-generate=FILE 実行回数を数えてFILEに書き出すコードを出力する
+char *profile_use;      // -fprofile-use=FILE FILEの実行回数をもとにコードを配置する
+char *lexer_mode;       // -lexer=scalar|sse2|avx2 トークナイザの実装を指定する 指定がなければCPUに合わせて選ぶ
+bool opt_dump_tokens;   // -dump-tokens トークンの列を出力して終了する
+bool opt_lex_only;      // -lex-only トークナイズだけを行い、トークンの数を出力して終了する
+int lexer_threads;      // -lexer-threads=N N個のスレッドで並列にトークナイズする 0ならCPUの数
+bool opt_pipeline;      // -pipeline トークナイズ・構文解析・コード生成を別々のスレッドで同時に行う
+bool stream_stmts;      // 文をcodeに溜めず、1つ構文解析するたびにコードを生成して捨てる
+
+int codegen_threads;    // -codegen-threads=N N個のスレッドで文ごとに並列にコードを生成する 0ならCPUの数
+char *cache_dir;        // -cache-dir=DIR コンパイル結果をDIRにキャッシュする
+long cache_max;         // -cache-max=SIZE キャッシュの大きさの上限
+bool opt_cache_stats;   // -cache-stats キャッシュの使われ方を表示して終了する
+char *watch_output;     // -watch=FILE 入力が書き換えられるたびにコンパイルし直し、FILEに書く
+
+//文のアセンブリのうち、生成したときの状態によって変わる部分 監視モードはここを書き換えて使い回す
+#define ASM_LABEL ".L"                  // .L<文の番号>_<文の中での番号>
+#define ASM_LOC ".loc 1 "               // .loc 1 <行> <列>
+#define ASM_VAR "[rbp-"                 // [rbp-<変数のオフセット>]
+#define ASM_COUNTER "__prof_counts+"    // __prof_counts+<カウンタの番号*8>
+
+typedef enum {
+    RELOC_ROOT,     // ラベルの文の番号
+    RELOC_LINE,     // .locの行
+    RELOC_VAR,      // 変数のオフセット
+    RELOC_COUNTER,  // カウンタのアドレス
+} RelocKind;
+
+void relocate_asm(FILE *out, char *buf, size_t len, long (*fix)(RelocKind kind, long val, void *arg), void *arg);
+
+//アセンブリの出力 状態はスレッドごとに持つ
+extern _Thread_local FILE *asm_out;
+extern _Thread_local int counter;
+extern _Thread_local bool used_cold;
 
-int counter;
+void begin_root(int root, FILE *out);
+
+void end_root();
+
+int new_label();
+
+int resolve_label(int label);
+
+void flush_pending();
+
+void emit(char *fmt, ...);
+
+void emit_label(int label);
+
+void emit_jmp(int label);
+
+void emit_jcc(char *cc, int label);
+
+void emit_directive(char *fmt, ...);
+
+void flush_loc();
+
+void emit_loc(int line, int col);
+
+int emit_subsection(int n);
+
+//プロファイルに基づく最適化
+int prof_count; //割り当てたカウンタの個数
+
+unsigned long source_hash;
+
+unsigned long hash_source(char *p);
+
+void load_profile(char *path);
+
+long prof_count_of(int id);
+
+void emit_counter(int id);
+
+void emit_profile_dump();
+
+void gen_profile_runtime();
 
 #define dump() fprintf(stderr, "%sの%d行目を実行しています\n", __FILE__, __LINE__)
+
+//1つのスレッドだけが入れ、1つのスレッドだけが取り出す、長さに上限のある待ち行列
+//ロックは使わず、入れる位置と取り出す位置をそれぞれのスレッドだけが書き換える
+//満杯や空で待つときはfutexで眠り、相手が進めたら起こされる
+typedef struct {
+    char *buf;
+    int elem_size;
+    unsigned mask;                  //容量-1 容量は2の冪
+    _Alignas(64) atomic_uint head;  //次に取り出す位置 取り出す側だけが書き換える
+    atomic_bool pop_waiting;        //取り出す側が空で眠っている
+    _Alignas(64) atomic_uint tail;  //次に入れる位置 入れる側だけが書き換える
+    atomic_bool push_waiting;       //入れる側が満杯で眠っている
+} Queue;
+
+Queue *new_queue(int elem_size, int cap);
+
+void queue_push(Queue *q, void *elem);
+
+void queue_pop(Queue *q, void *elem);
+
+void queue_flush(Queue *q);
+
+Queue *token_queue;     //-pipelineで、トークナイズするスレッドから構文解析するスレッドへトークンを渡す
+Queue *stmt_queue;      //-pipelineで、構文解析するスレッドからコードを生成するスレッドへ文の根を渡す
+
+void start_pipeline();
+
+Node *next_stmt();
+
+void finish_pipeline();
+
+//文ごとのコード生成
+typedef struct {
+    char *buf;      //文のアセンブリ
+    size_t len;
+    bool used_cold; //サブセクション1に出力したかどうか
+    bool failed;    //生成中にエラーになった
+} RootOut;
+
+void gen_root(int root, Node *node, RootOut *out);
+
+void write_root(RootOut *out);
+
+void gen_roots();
+
+//SHA-256
+typedef struct {
+    unsigned h[8];
+    unsigned char buf[64];
+    unsigned long len;  //これまでに入力したバイト数
+} Sha256;
+
+void sha256_init(Sha256 *s);
+
+void sha256_update(Sha256 *s, void *data, size_t n);
+
+void sha256_final(Sha256 *s, char *out);
+
+//コンパイル結果のキャッシュ
+bool cache_lookup(char *path);
+
+void cache_begin();
+
+void cache_commit();
+
+void print_cache_stats();
+
+//オプションを読んでコンパイルする
+int compile(int argc, char **argv);
+
+//コンパイル・アセンブル・リンク・実行を行うドライバ
+int drive(int argc, char **argv);
+
+int wait_status(pid_t pid);
+
+//入力を監視し、変わった文だけをコンパイルし直す
+int watch(char *path);
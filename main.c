@@ -1,37 +1,155 @@
+#define _DEFAULT_SOURCE
 #include "header.h"
 
+#include <unistd.h>
+
+// "64M"のように、K・M・Gを付けて書かれた大きさを読む
+long parse_size(char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    switch (*end) {
+        case 'K': case 'k': n <<= 10; break;
+        case 'M': case 'm': n <<= 20; break;
+        case 'G': case 'g': n <<= 30; break;
+    }
+    if (n <= 0) {
+        error("大きさの指定が正しくありません: %s", s);
+    }
+    return n;
+}
+
 int main(int argc, char **argv) {
+    return drive(argc, argv);
+}
 
-    char *user_input = read_file(argv[1]);
+//オプションを読み、入力をコンパイルしてアセンブリを標準出力に書く
+int compile(int argc, char **argv) {
+    char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-fno-if-conversion") == 0) {
+            no_if_conversion = true;
+        } else if (strncmp(argv[i], "-fprofile-generate=", 19) == 0) {
+            profile_generate = argv[i] + 19;
+        } else if (strncmp(argv[i], "-fprofile-use=", 14) == 0) {
+            profile_use = argv[i] + 14;
+        } else if (strncmp(argv[i], "-lexer=", 7) == 0) {
+            lexer_mode = argv[i] + 7;
+        } else if (strncmp(argv[i], "-lexer-threads=", 15) == 0) {
+            lexer_threads = atoi(argv[i] + 15);
+            if (lexer_threads <= 0) {
+                lexer_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (strncmp(argv[i], "-codegen-threads=", 17) == 0) {
+            codegen_threads = atoi(argv[i] + 17);
+            if (codegen_threads <= 0) {
+                codegen_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (strncmp(argv[i], "-cache-dir=", 11) == 0) {
+            cache_dir = argv[i] + 11;
+        } else if (strncmp(argv[i], "-cache-max=", 11) == 0) {
+            cache_max = parse_size(argv[i] + 11);
+        } else if (strcmp(argv[i], "-cache-stats") == 0) {
+            opt_cache_stats = true;
+        } else if (strncmp(argv[i], "-watch=", 7) == 0) {
+            watch_output = argv[i] + 7;
+        } else if (strcmp(argv[i], "-pipeline") == 0) {
+            opt_pipeline = true;
+        } else if (strcmp(argv[i], "-dump-tokens") == 0) {
+            opt_dump_tokens = true;
+        } else if (strcmp(argv[i], "-lex-only") == 0) {
+            opt_lex_only = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (cache_max == 0) {
+        cache_max = 64L << 20;
+    }
+    if (opt_cache_stats) {
+        if (!cache_dir) {
+            error("-cache-statsには-cache-dirが必要です");
+        }
+        print_cache_stats();
+        return 0;
+    }
+    if (!path) {
+        error("入力ファイルが指定されていません");
+    }
+    if (profile_generate && profile_use) {
+        error("-fprofile-generateと-fprofile-useは同時に指定できません");
+    }
+    if (watch_output) {
+        if (opt_pipeline || codegen_threads > 1) {
+            error("-watchは-pipeline・-codegen-threadsと同時に指定できません");
+        }
+        return watch(path);
+    }
 
-    fprintf(stderr, "%s\n", user_input);
+    user_input = read_file(path);
 
-    //グローバル変数tokenに、入力された文字列の最初の文字へのポインタを与える
-    token = tokenize(user_input);
+    // キャッシュにあれば、それを出力して終わる
+    if (cache_dir && !opt_dump_tokens && !opt_lex_only) {
+        if (cache_lookup(path)) {
+            fprintf(stderr, "Cache hit.\n");
+            return 0;
+        }
+        cache_begin();
+    }
 
-    // codeにNodeの列を保存する
-    program();
+    //トークンは構文解析しながら1つずつ読む
+    init_scanner(lexer_mode);
+    init_tokenizer(user_input);
+    if (opt_dump_tokens) {
+        dump_tokens();
+        return 0;
+    }
+    if (opt_lex_only) {
+        count_tokens();
+        return 0;
+    }
+
+    if (profile_generate || profile_use) {
+        source_hash = hash_source(user_input);
+    }
+
+    if (opt_pipeline) {
+        // 構文解析は別のスレッドで行い、終わった文から順にコードを生成する
+        start_pipeline();
+    } else if (codegen_threads > 1 || profile_use) {
+        // codeにNodeの列を保存する
+        // 並列に生成するには文がそろっている必要があり、プロファイルを読むには文の数が分かっている必要がある
+        token = next_token();
+        program();
+        fprintf(stderr, "\nTokens successfully parsed.\n\nGenerating code.\n\n");
+    } else {
+        // 文を1つ構文解析するたびにコードを生成し、構文木を捨てる
+        // 入力はトークンを読む位置の前後しか触らないので、入力が大きくてもメモリは文1つ分で済む
+        token = next_token();
+        stream_stmts = true;
+    }
 
-    fprintf(stderr, "\nTokens successfully parsed.\n\nGenerating code.\n\n");
+    if (profile_use) {
+        load_profile(profile_use);
+    }
 
-    //アセンブリの前半部分
-    printf(".intel_syntax noprefix\n");
-    printf(".globl main\n");
-    printf("main:\n");
+    //アセンブリの前半部分とプロローグ
+    gen_prologue(path);
 
-    //プロローグ
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, 208\n");
+    gen_roots();
 
-    for (int i = 0; code[i]; i++) {
-        gen(code[i]);
-        printf("  pop rax\n");
+    if (opt_pipeline) {
+        finish_pipeline();
     }
 
     // エピローグ
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
+    gen_epilogue();
+    emit_directive(".cfi_endproc");
+    emit_directive(".size main, .-main");
+
+    gen_profile_runtime();
+
+    if (cache_dir) {
+        cache_commit();
+    }
     return 0;
 }
\ No newline at end of file
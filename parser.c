@@ -13,7 +13,7 @@ bool consume(char *op) {
         return false;
     }
     parse_log();
-    token = token->next;
+    token = next_token();
     return true;
 }
 
@@ -27,7 +27,7 @@ Token *consume_ident() {
     }
     Token *res = token;
     parse_log();
-    token = token->next;
+    token = next_token();
     return res;
 }
 
@@ -36,7 +36,7 @@ bool consume_return() {
         return false;
     }
     parse_log();
-    token = token->next;
+    token = next_token();
     return true;
 }
 
@@ -45,7 +45,7 @@ bool consume_if() {
         return false;
     }
     parse_log();
-    token = token->next;
+    token = next_token();
     return true;
 }
 
@@ -54,7 +54,7 @@ bool consume_else() {
         return false;
     }
     parse_log();
-    token = token->next;
+    token = next_token();
     return true;
 }
 
@@ -63,7 +63,7 @@ bool consume_while() {
         return false;
     }
     parse_log();
-    token = token->next;
+    token = next_token();
     return true;
 }
 
@@ -72,7 +72,7 @@ bool consume_for() {
         return false;
     }
     parse_log();
-    token = token->next;
+    token = next_token();
     return true;
 }
 
@@ -91,27 +91,38 @@ void expect(char *op) {
         error_at(token->str, "expected \"%s\"", op);
     }
     parse_log();
-    token = token->next;
+    token = next_token();
 }
 
 //数字が先頭に来ているかチェックする
 int expect_number() {
     if (token->kind != TK_NUM) {
-//        error_at(token->str, "数ではありません");
-        dump();
-        exit(1);
+        error_at(token->str, "数ではありません");
     }
     int val = token->val;
     parse_log();
-    token = token->next;
+    token = next_token();
     return val;
 }
 
+//ノードの位置をトークンの位置にする
+void set_pos(Node *node, Token *tok) {
+    node->line = tok->line;
+    node->col = tok->col;
+}
+
+//二項演算のノードは左辺の位置を引き継ぐ 左辺がなければ現在のトークンの位置にする
 Node *new_node(NodeKind kind, Node *lhs, Node *rhs) {
     Node *node = calloc(1, sizeof(Node));
     node->kind = kind;
     node->lhs = lhs;
     node->rhs = rhs;
+    if (lhs) {
+        node->line = lhs->line;
+        node->col = lhs->col;
+    } else {
+        set_pos(node, token);
+    }
     return node;
 }
 
@@ -119,6 +130,7 @@ Node *new_node_num(int val) {
     Node *node = calloc(1, sizeof(Node));
     node->kind = ND_NUM;
     node->val = val;
+    set_pos(node, token);
     return node;
 }
 
@@ -183,16 +195,61 @@ char *node_name[17] = {
 //複数の文からなるプログラムを書くために、二分木ではなくN分木にする(左右の子だけでなく配列を使う)
 //変数の宣言などに対応する値を返さない「void型のノード」が必要になる
 void program() {
-    int i = 0;
     while (!at_eof()) {
-        code[i++] = stmt();
+        push_code(stmt());
+    }
+    push_code(NULL);
+    if (stmt_queue) {
+        queue_flush(stmt_queue);
+    }
+}
+
+//codeの末尾に文を追加する 足りなくなったら領域を倍に広げる
+//NULLは終わりの印として置くだけで、code_lenには数えない
+//-pipelineでは、codeには溜めずにコードを生成するスレッドへ渡す
+void push_code(Node *node) {
+    if (stmt_queue) {
+        queue_push(stmt_queue, &node);
+        return;
+    }
+    if (code_len == code_cap) {
+        code_cap = code_cap ? code_cap * 2 : 64;
+        code = realloc(code, sizeof(Node *) * code_cap);
+    }
+    code[code_len] = node;
+    if (node) {
+        code_len++;
+    }
+}
+
+//構文木を解放する コードを生成し終えた文を捨てるのに使う
+void free_tree(Node *node) {
+    if (!node) {
+        return;
+    }
+    free_tree(node->lhs);
+    free_tree(node->rhs);
+    free_tree(node->if_cond);
+    free_tree(node->if_true);
+    free_tree(node->if_false);
+    free_tree(node->for_init);
+    free_tree(node->for_cond);
+    free_tree(node->for_upd);
+    free_tree(node->for_content);
+    for (cell *c = node->compound.head; c; ) {
+        cell *next = c->next;
+        free_tree(c->stmt);
+        free(c);
+        c = next;
     }
-    code[i] = NULL;
+    free(node);
 }
 
 //それぞれ、対応する種類のノードを根とする木を構築し、根へのポインタを返す
 Node *stmt() {
     fprintf(stderr, "Reading stmt.\n");
+    //トークンは使い回されるので、位置だけをコピーしておく
+    Token start = *token;
     Node *node;
     node = calloc(1, sizeof(Node));
 
@@ -201,14 +258,15 @@ Node *stmt() {
         node->kind = ND_RETURN;
         node->lhs = expr();
         if (at_eof()) {
-            fprintf(stderr, "expected \"%c\"", ';');
-            exit(1);
+            error("expected \";\"");
         }
         //;は区切りの意味しかないので、expectで進める
         expect(";");
     } else if (consume_if()) {
 
         node->kind = ND_IF;
+        node->prof_id = prof_count;
+        prof_count += 2;
         expect("(");
         node->if_cond = expr();
         expect(")");
@@ -219,6 +277,8 @@ Node *stmt() {
 
         expect("(");
         node->kind = ND_WHILE;
+        node->prof_id = prof_count;
+        prof_count += 2;
         node->lhs = expr();
         expect(")");
         node->rhs = stmt();
@@ -226,6 +286,8 @@ Node *stmt() {
     } else if (consume_for()) {
         expect("(");
         node->kind = ND_FOR;
+        node->prof_id = prof_count;
+        prof_count += 2;
 
         // for文の初期化
         if (consume(";")) {
@@ -275,8 +337,7 @@ Node *stmt() {
             }
 
             if(tmp == 10) {
-                fprintf(stderr, "複文が閉じていません\n");
-                exit(1);
+                error("複文が閉じていません");
             }
         }
 
@@ -284,120 +345,167 @@ Node *stmt() {
 
 
     } else {
+        //式文は式の木をそのまま文の根にする
+        free(node);
         node = expr();
         if (at_eof()) {
-            fprintf(stderr, "expected \"%c\"", ';');
-            exit(1);
+            error("expected \";\"");
         }
         //;は区切りの意味しかないので、expectで進める
         expect(";");
     }
 
+    set_pos(node, &start);
     fprintf(stderr, "Created node of type %s.\n", node_name[node->kind]);
     return node;
 }
 
-Node *expr() {
-    fprintf(stderr, "Reading expr.\n");
-    return assign();
-}
+//式の構文解析 演算子の優先順位の表と明示的なスタックを使う(優先順位法)
+//  expr    = unary (binop unary)*
+//  unary   = ("+" | "-")? primary
+//  primary = "(" expr ")" | ident | num
+//二項演算子の優先順位と結合の向きは次の通り 上ほど弱い
+//  =              右結合
+//  == !=          左結合
+//  < <= > >=      左結合 > と >= は左右を入れ替えて < と <= にする
+//  + -            左結合
+//  * /            左結合
+//括弧も関数呼び出しではなくスタックで扱うので、式がどれだけ深くてもCのスタックは伸びない
+
+typedef struct {
+    char *str;
+    int len;
+    NodeKind kind;
+    int prec;       //優先順位 大きいほど強く結びつく
+    bool right;     //右結合かどうか
+    bool swap;      //左右の子を入れ替えるかどうか
+} BinOpInfo;
+
+BinOpInfo prec_table[] = {
+    {"=",  1, ND_ASSIGN, 1, true,  false},
+    {"==", 2, ND_EQ,     2, false, false},
+    {"!=", 2, ND_NE,     2, false, false},
+    {"<",  1, ND_LT,     3, false, false},
+    {"<=", 2, ND_LE,     3, false, false},
+    {">",  1, ND_LT,     3, false, true},
+    {">=", 2, ND_LE,     3, false, true},
+    {"+",  1, ND_ADD,    4, false, false},
+    {"-",  1, ND_SUB,    4, false, false},
+    {"*",  1, ND_MUL,    5, false, false},
+    {"/",  1, ND_DIV,    5, false, false},
+};
 
-Node *assign() {
-    fprintf(stderr, "Reading assign.\n");
-    Node *node = equality();
-    if (consume("=")) {
-        node = new_node(ND_ASSIGN, node, assign());
+//演算子のスタックの要素
+//opがNULLなら開き括弧 括弧の前に単項の-があれば、括弧を閉じた後に0から引く
+typedef struct {
+    BinOpInfo *op;
+    Node *zero;     //単項の-の左辺の0 -がなければNULL
+} OpEntry;
+
+//式を読むたびに作り直さないよう、スタックの領域は使い回す
+Node **operand_stack;
+int operand_cap;
+OpEntry *op_stack;
+int op_cap;
+
+//現在のトークンが二項演算子なら、その情報を返す
+BinOpInfo *peek_binop() {
+    if (token->kind != TK_RESERVED) {
+        return NULL;
     }
-
-    return node;
-}
-
-Node *equality() {
-    fprintf(stderr, "Reading equality.\n");
-    Node *node = relation();
-    for (;;) {
-        if (consume("==")) {
-            node = new_node(ND_EQ, node, relation());
-        } else if (consume("!=")) {
-            node = new_node(ND_NE, node, relation());
-        } else {
-            return node;
+    for (int i = 0; i < sizeof(prec_table) / sizeof(prec_table[0]); i++) {
+        if (prec_table[i].len == token->len && memcmp(prec_table[i].str, token->str, token->len) == 0) {
+            return &prec_table[i];
         }
     }
+    return NULL;
 }
 
-Node *relation() {
-    fprintf(stderr, "Reading relation.\n");
-    Node *node = add();
-    for (;;) {
-        if (consume("<")) {
-            node = new_node(ND_LT, node, add());
-        } else if (consume("<=")) {
-            node = new_node(ND_LE, node, add());
-        } else if (consume(">")) {
-            node = new_node(ND_LT, add(), node);
-        } else if (consume(">=")) {
-            node = new_node(ND_LE, add(), node);
-        } else {
-            return node;
-        }
-    }
-}
+Node *expr() {
+    fprintf(stderr, "Reading expr.\n");
+    int nopnd = 0;
+    int nop = 0;
 
-Node *add() {
-    fprintf(stderr, "Reading add.\n");
-    Node *node = mul();
     for (;;) {
+        //被演算子を読む 単項演算子と開き括弧はスタックに積んで読み進める
+        Node *zero = NULL;
         if (consume("+")) {
-            node = new_node(ND_ADD, node, mul());
         } else if (consume("-")) {
-            node = new_node(ND_SUB, node, mul());
-        } else {
-            return node;
+            zero = new_node_num(0);
+        }
+        if (consume("(")) {
+            if (nop == op_cap) {
+                op_cap = op_cap ? op_cap * 2 : 64;
+                op_stack = realloc(op_stack, sizeof(OpEntry) * op_cap);
+            }
+            op_stack[nop++] = (OpEntry){NULL, zero};
+            continue;
+        }
+        Node *node = primary();
+        if (zero) {
+            node = new_node(ND_SUB, zero, node);
         }
-    }
-}
 
+        for (;;) {
+            if (nopnd == operand_cap) {
+                operand_cap = operand_cap ? operand_cap * 2 : 64;
+                operand_stack = realloc(operand_stack, sizeof(Node *) * operand_cap);
+            }
+            operand_stack[nopnd++] = node;
+
+            //次の演算子より強く結びつく演算子を、スタックから下ろして木にする
+            //括弧を閉じるときと式の終わりでは、開き括弧まですべて下ろす
+            BinOpInfo *next = peek_binop();
+            while (nop > 0 && op_stack[nop - 1].op) {
+                BinOpInfo *op = op_stack[nop - 1].op;
+                if (next && (op->prec < next->prec || (op->prec == next->prec && next->right))) {
+                    break;
+                }
+                Node *rhs = operand_stack[--nopnd];
+                Node *lhs = operand_stack[--nopnd];
+                operand_stack[nopnd++] = op->swap ? new_node(op->kind, rhs, lhs) : new_node(op->kind, lhs, rhs);
+                nop--;
+            }
 
-Node *mul() {
-    fprintf(stderr, "Reading mul.\n");
-    Node *node = unary();
-    for (;;) {
-        if (consume("*")) {
-            node = new_node(ND_MUL, node, unary());
-        } else if (consume("/")) {
-            node = new_node(ND_DIV, node, unary());
-        } else {
-            return node;
+            if (next) {
+                consume(next->str);
+                if (nop == op_cap) {
+                    op_cap = op_cap ? op_cap * 2 : 64;
+                    op_stack = realloc(op_stack, sizeof(OpEntry) * op_cap);
+                }
+                op_stack[nop++] = (OpEntry){next, NULL};
+                break;
+            }
+            //下ろし終えてスタックに残っているのは開き括弧だけ
+            bool close = nop > 0 && token->kind == TK_RESERVED && token->len == 1 && *token->str == ')';
+            if (close) {
+                //開き括弧を下ろし、括弧の中身を1つの被演算子として続きを読む
+                expect(")");
+                node = operand_stack[--nopnd];
+                Node *paren_zero = op_stack[--nop].zero;
+                if (paren_zero) {
+                    node = new_node(ND_SUB, paren_zero, node);
+                }
+                continue;
+            }
+            if (nop > 0) {
+                //閉じていない括弧がある
+                expect(")");
+            }
+            return operand_stack[--nopnd];
         }
     }
 }
 
-Node *unary() {
-    fprintf(stderr, "Reading unary.\n");
-    if (consume("+")) {
-        return primary();
-    } else if (consume("-")) {
-        return new_node(ND_SUB, new_node_num(0), primary());
-    } else {
-        return primary();
-    }
-}
-
-
+//変数か数を読む 括弧と単項演算子はexprで扱う
 Node *primary() {
     fprintf(stderr, "Reading primary.\n");
-    if (consume("(")) {
-        Node *node = expr();
-        expect(")");
-        return node;
-    }
-
     Token *tok = consume_ident();
 
     if (tok) {
         Node *node = calloc(1, sizeof(Node));
         node->kind = ND_LVAR;
+        set_pos(node, tok);
 
         LVar *lvar = find_lvar(tok);
 
@@ -424,5 +532,8 @@ Node *primary() {
     }
 
 
-    return new_node_num(expect_number());
+    Token num = *token;
+    Node *node = new_node_num(expect_number());
+    set_pos(node, &num);
+    return node;
 }
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "header.h"
+
+// -pipeline : トークナイズ・構文解析・コード生成を別々のスレッドで同時に行う
+//   トークナイズするスレッド --token_queue--> 構文解析するスレッド --stmt_queue--> コード生成(mainのスレッド)
+// 文を1つ構文解析し終えるたびにコードを生成するので、入力を最後まで読む前にアセンブリが出力され始める
+// トークンの番号と表示は構文解析するスレッドのnext_token()で行うので、標準エラー出力も逐次の場合と同じになる
+//
+// -fprofile-useではプロファイルを読む前に文の数が決まっている必要があるので、
+// コード生成は構文解析が終わるのを待ってから行う
+//
+// 構文解析するスレッドでエラーになっても、そのスレッドでは終了しない(mainのスレッドは出力の途中かもしれない)
+// エラーを表示したらparse_errorを待ち行列に入れて終わり、mainのスレッドがそれを受け取ってから終了する
+
+#define TOKEN_QUEUE_CAP 1024
+#define STMT_QUEUE_CAP 256
+
+pthread_t lexer_thread;
+pthread_t parser_thread;
+int stmt_pos;  // 待ち行列を使わない場合に、次にnext_stmt()で返すcodeの位置
+Node parse_error;       // 構文解析するスレッドがエラーになったことを表す文
+bool parse_failed;      // 待ち行列を使わない場合に、構文解析するスレッドがエラーになった
+
+void *lexer_main(void *arg) {
+    // 行番号はスレッドごとに数えるので、このスレッドで数え始める
+    token_line = 1;
+    token_line_start = token_pos;
+
+    for (;;) {
+        Token tok;
+        if (!read_token(&tok)) {
+            // 読めない文字 構文解析がここまで来たときにエラーにできるよう、strをNULLにして渡す
+            tok.str = NULL;
+            queue_push(token_queue, &tok);
+            queue_flush(token_queue);
+            return NULL;
+        }
+        queue_push(token_queue, &tok);
+        if (tok.kind == TK_EOF) {
+            queue_flush(token_queue);
+            return NULL;
+        }
+    }
+}
+
+void *parser_main(void *arg) {
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        if (stmt_queue) {
+            Node *node = &parse_error;
+            queue_push(stmt_queue, &node);
+            queue_flush(stmt_queue);
+        }
+        parse_failed = true;
+        return NULL;
+    }
+    error_jmp = &jb;
+
+    token = next_token();
+    program();
+    fprintf(stderr, "\nTokens successfully parsed.\n\nGenerating code.\n\n");
+    return NULL;
+}
+
+void start_pipeline() {
+    token_queue = new_queue(sizeof(Token), TOKEN_QUEUE_CAP);
+    if (!profile_use) {
+        stmt_queue = new_queue(sizeof(Node *), STMT_QUEUE_CAP);
+    }
+
+    if (pthread_create(&lexer_thread, NULL, lexer_main, NULL) != 0 ||
+        pthread_create(&parser_thread, NULL, parser_main, NULL) != 0) {
+        error("スレッドを作れません");
+    }
+
+    if (!stmt_queue) {
+        pthread_join(parser_thread, NULL);
+        if (parse_failed) {
+            error_exit();
+        }
+    }
+}
+
+// 次にコードを生成する文を返す 最後の文の次はNULL
+Node *next_stmt() {
+    if (stream_stmts) {
+        return at_eof() ? NULL : stmt();
+    }
+    if (stmt_queue) {
+        Node *node;
+        queue_pop(stmt_queue, &node);
+        if (node == &parse_error) {
+            error_exit();
+        }
+        return node;
+    }
+    return code[stmt_pos++];
+}
+
+void finish_pipeline() {
+    if (stmt_queue) {
+        pthread_join(parser_thread, NULL);
+    }
+    pthread_join(lexer_thread, NULL);
+}
@@ -0,0 +1,146 @@
+#include "header.h"
+
+// プロファイルに基づく最適化(PGO)
+// -fprofile-generate=FILE でコンパイルしたプログラムは、if文の各節とループの本体を実行した回数を数え、
+// mainから戻るときにFILEに書き出す
+// -fprofile-use=FILE でコンパイルすると、その回数をもとにコードの配置を決める
+//
+// プロファイルのファイルは次の64ビット整数を並べたもの
+//   PROFILE_MAGIC, 入力のハッシュ値, カウンタの個数N, カウンタ0, ..., カウンタN-1
+// カウンタの番号は構文解析のときにprof_countから割り当てる
+//   ND_IF    : prof_id = then節の実行回数, prof_id + 1 = else節の実行回数
+//   ND_WHILE : prof_id = ループに入った回数, prof_id + 1 = 本体の実行回数
+//   ND_FOR   : ND_WHILEと同じ
+
+#define PROFILE_MAGIC 0x31304652504343L // "CCPRF01"
+
+long *profile;  // 読み込んだカウンタ -fprofile-useでなければNULL
+
+// 入力のハッシュ値(FNV-1a) 別の入力のプロファイルを使わないように確かめる
+unsigned long hash_source(char *p) {
+    unsigned long h = 14695981039346656037UL;
+    for (; *p; p++) {
+        h ^= (unsigned char) *p;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// プロファイルを読み込む カウンタの番号は構文解析で決まるので、program()の後に呼ぶこと
+// 読めない、または入力と合わない場合は警告を出してプロファイルなしでコンパイルする
+// -watchでは入力が変わるたびに読み直すので、前に読んだプロファイルは捨てる
+void load_profile(char *path) {
+    profile = NULL;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "warning: プロファイル%sを開けません\n", path);
+        return;
+    }
+
+    long header[3];
+    if (fread(header, sizeof(long), 3, fp) != 3 || header[0] != PROFILE_MAGIC) {
+        fprintf(stderr, "warning: %sはプロファイルではありません\n", path);
+        fclose(fp);
+        return;
+    }
+    if ((unsigned long) header[1] != source_hash || header[2] != prof_count) {
+        fprintf(stderr, "warning: プロファイル%sは別の入力のものです\n", path);
+        fclose(fp);
+        return;
+    }
+
+    long *counts = calloc(prof_count + 1, sizeof(long));
+    if (fread(counts, sizeof(long), prof_count, fp) != prof_count) {
+        fprintf(stderr, "warning: プロファイル%sが途中で切れています\n", path);
+        free(counts);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+    profile = counts;
+}
+
+// カウンタidの値を返す プロファイルがなければ-1
+long prof_count_of(int id) {
+    if (!profile) {
+        return -1;
+    }
+    return profile[id];
+}
+
+// カウンタidを1増やす命令を出力する
+void emit_counter(int id) {
+    if (profile_generate) {
+        emit("add QWORD PTR [rip+" ASM_COUNTER "%d], 1", id * 8);
+    }
+}
+
+// mainから戻る直前にプロファイルを書き出す
+void emit_profile_dump() {
+    if (profile_generate) {
+        emit("call __prof_dump");
+    }
+}
+
+// カウンタの領域と、それをファイルに書き出す関数__prof_dumpを出力する
+// libcに頼らずシステムコールだけで書き出す raxにはmainの戻り値が入っているので保存する
+void gen_profile_runtime() {
+    if (!profile_generate) {
+        return;
+    }
+    flush_pending();
+
+    printf(".data\n");
+    printf(".p2align 3\n");
+    printf("__prof_data:\n");
+    printf("  .quad %ld\n", PROFILE_MAGIC);
+    printf("  .quad %ld\n", (long) source_hash);
+    printf("  .quad %d\n", prof_count);
+    printf("__prof_counts:\n");
+    printf("  .zero %d\n", prof_count * 8);
+
+    printf(".section .rodata\n");
+    printf(".Lprof_path:\n");
+    printf("  .string \"");
+    for (char *p = profile_generate; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            printf("\\");
+        }
+        printf("%c", *p);
+    }
+    printf("\"\n");
+
+    printf(".text\n");
+    printf("__prof_dump:\n");
+    printf("  push rax\n");
+    printf("  push rdi\n");
+    printf("  push rsi\n");
+    printf("  push rdx\n");
+    printf("  push rcx\n");
+    printf("  push r11\n");
+    // open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+    printf("  mov eax, 2\n");
+    printf("  lea rdi, [rip+.Lprof_path]\n");
+    printf("  mov esi, 577\n");
+    printf("  mov edx, 420\n");
+    printf("  syscall\n");
+    printf("  test rax, rax\n");
+    printf("  js .Lprof_done\n");
+    // write(fd, __prof_data, size)
+    printf("  mov rdi, rax\n");
+    printf("  mov eax, 1\n");
+    printf("  lea rsi, [rip+__prof_data]\n");
+    printf("  mov edx, %d\n", (prof_count + 3) * 8);
+    printf("  syscall\n");
+    // close(fd)
+    printf("  mov eax, 3\n");
+    printf("  syscall\n");
+    printf(".Lprof_done:\n");
+    printf("  pop r11\n");
+    printf("  pop rcx\n");
+    printf("  pop rdx\n");
+    printf("  pop rsi\n");
+    printf("  pop rdi\n");
+    printf("  pop rax\n");
+    printf("  ret\n");
+}
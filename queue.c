@@ -0,0 +1,88 @@
+#define _DEFAULT_SOURCE
+#include "header.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// 1つのスレッドだけが入れ、1つのスレッドだけが取り出す待ち行列(SPSCキュー)
+// headとtailは増やし続け、容量で割った余りを位置として使う
+// 入れる側は要素を書いてからtailを進め(release)、取り出す側はtailを読んでから要素を読む(acquire)
+// 満杯や空のときは少しだけ相手が進むのを見張り、それでも進まなければfutexで眠る
+//   眠る側: 眠ることをwaitingに書く → 相手の位置を読み直す → 変わっていなければ眠る
+//   起こす側: 自分の位置を書く → waitingを読む → 眠っていれば起こす
+// どちらもseq_cstで書いてから読むので、少なくとも一方は相手の書いた値を見る(起こし忘れない)
+// 1つ入れる・取り出すたびに起こすと、CPUが足りないときに1要素ごとに眠って起こされるのを繰り返すので、
+// 空で眠った側は半分まで溜まったとき、満杯で眠った側は半分まで空いたときに起こす
+// 最後の要素は半分に届かないかもしれないので、入れ終えたらqueue_flushで起こす
+
+#define SPIN_COUNT 100
+
+Queue *new_queue(int elem_size, int cap) {
+    if (cap & (cap - 1)) {
+        error("待ち行列の容量は2の冪にしてください");
+    }
+    Queue *q = calloc(1, sizeof(Queue));
+    q->buf = calloc(cap, elem_size);
+    q->elem_size = elem_size;
+    q->mask = cap - 1;
+    return q;
+}
+
+// *addrがvalのままなら、起こされるまで眠る
+static void futex_wait(atomic_uint *addr, unsigned val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void queue_push(Queue *q, void *elem) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (int i = 0; tail - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask; i++) {
+        if (i < SPIN_COUNT) {
+            continue;
+        }
+        atomic_store(&q->push_waiting, true);
+        unsigned head = atomic_load(&q->head);
+        if (tail - head > q->mask) {
+            futex_wait(&q->head, head);
+        }
+        atomic_store_explicit(&q->push_waiting, false, memory_order_relaxed);
+    }
+    memcpy(q->buf + (tail & q->mask) * q->elem_size, elem, q->elem_size);
+    atomic_store(&q->tail, tail + 1);
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (atomic_load(&q->pop_waiting) && tail + 1 - head == (q->mask + 1) / 2) {
+        futex_wake(&q->tail);
+    }
+}
+
+// 入れ終えたときに呼ぶ 空で眠っている取り出す側を、半分溜まるのを待たずに起こす
+void queue_flush(Queue *q) {
+    if (atomic_load(&q->pop_waiting)) {
+        futex_wake(&q->tail);
+    }
+}
+
+void queue_pop(Queue *q, void *elem) {
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (int i = 0; atomic_load_explicit(&q->tail, memory_order_acquire) == head; i++) {
+        if (i < SPIN_COUNT) {
+            continue;
+        }
+        atomic_store(&q->pop_waiting, true);
+        unsigned tail = atomic_load(&q->tail);
+        if (tail == head) {
+            futex_wait(&q->tail, tail);
+        }
+        atomic_store_explicit(&q->pop_waiting, false, memory_order_relaxed);
+    }
+    memcpy(elem, q->buf + (head & q->mask) * q->elem_size, q->elem_size);
+    atomic_store(&q->head, head + 1);
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (atomic_load(&q->push_waiting) && tail - (head + 1) == (q->mask + 1) / 2) {
+        futex_wake(&q->head);
+    }
+}
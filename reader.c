@@ -1,25 +1,77 @@
+#define _DEFAULT_SOURCE
 #include "header.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 入力を読み込み、末尾が改行と'\0'で終わる文字列として返す
+//
+// 通常のファイルはmmapで読み込み、内容をコピーしない
+// ファイルの後ろに0で埋めたページを必ず1つ以上置くので、末尾に改行と'\0'を足せるうえ、
+// トークナイザのベクトル読み込みが終端の'\0'を越えてもマップされた領域に収まる
+// パス"-"(標準入力)やパイプなど、大きさが分からない入力はread()で読み切る
 char *read_file(char *path) {
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
-        fprintf(stderr, "Cannot open input file.\n");
-        exit(1);
+    int fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+    if (fd < 0) {
+        error("Cannot open input file.");
     }
 
-    fseek(fp, 0, SEEK_END);
-    long int size = ftell(fp);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return read_stream(fd);
+    }
 
+    long page = sysconf(_SC_PAGESIZE);
+    long size = st.st_size;
+    // 改行と'\0'を足したうえで切り上げ、さらに0で埋めたページを1つ足す
+    long len = (size + 2 + page - 1) / page * page + page;
 
-    char *buf = calloc(1, size + 2);
-    fseek(fp, 0, SEEK_SET);
+    // 先に0で埋めた領域を確保し、その先頭にファイルを重ねてマップする
+    // MAP_PRIVATEなので、末尾に書き足してもファイルは変わらない
+    char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        error("入力を読み込めません: %s", path);
+    }
+    if (size > 0 && mmap(buf, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        error("入力を読み込めません: %s", path);
+    }
+    close(fd);
 
-    fread(buf, size, 1, fp);
+    if (size == 0 || buf[size - 1] != '\n') {
+        buf[size++] = '\n';
+    }
+    buf[size] = '\0';
+    return buf;
+}
+
+char *read_stream(int fd) {
+    long cap = 4096;
+    long size = 0;
+    char *buf = malloc(cap);
+    for (;;) {
+        // 改行と'\0'、ベクトル読み込みの余白の分を空けておく
+        if (cap - size < 1024) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        long n = read(fd, buf + size, cap - size - 64);
+        if (n < 0) {
+            error("入力を読み込めません");
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    if (fd != 0) {
+        close(fd);
+    }
 
-    if(size == 0 || buf[size - 1] != '\n') {
+    if (size == 0 || buf[size - 1] != '\n') {
         buf[size++] = '\n';
     }
     buf[size] = '\0';
-    fclose(fp);
     return buf;
-}
\ No newline at end of file
+}
@@ -0,0 +1,200 @@
+#include "header.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// トークナイザが使う、同じ種類の文字が続く範囲を読み飛ばす関数
+// 空白・識別子・数字の連続を、SSE2では16バイト、AVX2では32バイトずつまとめて判定する
+//
+// ベクトルの読み込みはアドレスを16(32)バイト境界に揃えて行う
+// 境界に揃えた読み込みはページをまたがないので、入力の終端の'\0'より先を読んでも落ちない
+// 読み込んだうちpより前の部分はマスクで無視する
+
+enum {
+    SC_SPACE, // 空白 isspaceと同じく' ', '\t', '\n', '\v', '\f', '\r'
+    SC_IDENT, // 識別子に使える文字 is_alnumと同じく英数字と'_'
+    SC_DIGIT, // 数字
+};
+
+// 読み飛ばした空白に含まれる改行を数え、行番号と行の先頭を更新する
+// nlはbaseから始まる改行の位置のビットマスク
+void count_newlines(char *base, unsigned long nl) {
+    if (nl) {
+        token_line += __builtin_popcountl(nl);
+        token_line_start = base + (63 - __builtin_clzl(nl)) + 1;
+    }
+}
+
+char *scan_scalar(char *p, int cls) {
+    for (;; p++) {
+        unsigned char c = *p;
+        bool in;
+        switch (cls) {
+            case SC_SPACE:
+                in = c == ' ' || (c >= '\t' && c <= '\r');
+                break;
+            case SC_IDENT:
+                in = is_alnum(c);
+                break;
+            default:
+                in = '0' <= c && c <= '9';
+                break;
+        }
+        if (!in) {
+            return p;
+        }
+        if (c == '\n') {
+            count_newlines(p, 1);
+        }
+    }
+}
+
+#ifdef __x86_64__
+
+// 各バイトがlo以上hi以下なら0xff、そうでなければ0
+// 符号なしで c - lo <= hi - lo かどうかを、min(c - lo, hi - lo) == c - lo で調べる
+static inline __m128i in_range_sse2(__m128i v, char lo, char hi) {
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(hi - lo)), t);
+}
+
+static inline unsigned class_sse2(__m128i v, int cls) {
+    __m128i in;
+    switch (cls) {
+        case SC_SPACE:
+            in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range_sse2(v, '\t', '\r'));
+            break;
+        case SC_IDENT: {
+            // 0x20をORすると英大文字は小文字になる
+            __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            in = _mm_or_si128(in_range_sse2(lower, 'a', 'z'), in_range_sse2(v, '0', '9'));
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+            break;
+        }
+        default:
+            in = in_range_sse2(v, '0', '9');
+            break;
+    }
+    return _mm_movemask_epi8(in);
+}
+
+char *scan_sse2(char *p, int cls) {
+    int off = (unsigned long) p & 15;
+    char *base = p - off;
+    unsigned valid = 0xffff << off & 0xffff;
+
+    for (;; base += 16, valid = 0xffff) {
+        __m128i v = _mm_load_si128((__m128i *) base);
+        unsigned stop = ~class_sse2(v, cls) & valid;
+        unsigned nl = 0;
+        if (cls == SC_SPACE) {
+            nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))) & valid;
+        }
+        if (stop) {
+            int i = __builtin_ctz(stop);
+            count_newlines(base, nl & ((1u << i) - 1));
+            return base + i;
+        }
+        count_newlines(base, nl);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i in_range_avx2(__m256i v, char lo, char hi) {
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(hi - lo)), t);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned class_avx2(__m256i v, int cls) {
+    __m256i in;
+    switch (cls) {
+        case SC_SPACE:
+            in = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range_avx2(v, '\t', '\r'));
+            break;
+        case SC_IDENT: {
+            __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            in = _mm256_or_si256(in_range_avx2(lower, 'a', 'z'), in_range_avx2(v, '0', '9'));
+            in = _mm256_or_si256(in, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+            break;
+        }
+        default:
+            in = in_range_avx2(v, '0', '9');
+            break;
+    }
+    return _mm256_movemask_epi8(in);
+}
+
+__attribute__((target("avx2")))
+char *scan_avx2(char *p, int cls) {
+    int off = (unsigned long) p & 31;
+    char *base = p - off;
+    unsigned valid = 0xffffffffu << off;
+
+    for (;; base += 32, valid = 0xffffffffu) {
+        __m256i v = _mm256_load_si256((__m256i *) base);
+        unsigned stop = ~class_avx2(v, cls) & valid;
+        unsigned nl = 0;
+        if (cls == SC_SPACE) {
+            nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))) & valid;
+        }
+        if (stop) {
+            int i = __builtin_ctz(stop);
+            count_newlines(base, nl & ((1u << i) - 1));
+            return base + i;
+        }
+        count_newlines(base, nl);
+    }
+}
+
+#endif
+
+char *(*scan)(char *p, int cls) = scan_scalar;
+
+// 使う実装を選ぶ modeがNULLなら、CPUが対応している中で一番速いものを使う
+void init_scanner(char *mode) {
+    if (mode && strcmp(mode, "scalar") == 0) {
+        scan = scan_scalar;
+        return;
+    }
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    if (mode == NULL) {
+        scan = avx2 ? scan_avx2 : scan_sse2;
+        return;
+    }
+    if (strcmp(mode, "sse2") == 0) {
+        scan = scan_sse2;
+        return;
+    }
+    if (strcmp(mode, "avx2") == 0) {
+        if (!avx2) {
+            error("このCPUはAVX2に対応していません");
+        }
+        scan = scan_avx2;
+        return;
+    }
+#else
+    if (mode == NULL) {
+        return;
+    }
+#endif
+    error("不明なトークナイザの実装です: %s", mode);
+}
+
+// pから続く空白を読み飛ばし、その次の文字へのポインタを返す 改行を数えて行番号を更新する
+char *skip_space(char *p) {
+    return scan(p, SC_SPACE);
+}
+
+// pから続く識別子の文字を読み飛ばす
+char *skip_ident(char *p) {
+    return scan(p, SC_IDENT);
+}
+
+// pから続く数字を読み飛ばす
+char *skip_digit(char *p) {
+    return scan(p, SC_DIGIT);
+}
@@ -0,0 +1,93 @@
+#include "header.h"
+
+// SHA-256 (FIPS 180-4) コンパイル結果のキャッシュのキーに使う
+
+static const unsigned k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static unsigned rotr(unsigned x, int n) {
+    return x >> n | x << (32 - n);
+}
+
+// 64バイトのブロックを1つ処理する
+static void sha256_block(Sha256 *s, unsigned char *p) {
+    unsigned w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (unsigned) p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        unsigned s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ w[i - 15] >> 3;
+        unsigned s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    unsigned a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    unsigned e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        unsigned t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        unsigned t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_init(Sha256 *s) {
+    static const unsigned h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(s->h, h0, sizeof(h0));
+    s->len = 0;
+}
+
+void sha256_update(Sha256 *s, void *data, size_t n) {
+    unsigned char *p = data;
+    while (n > 0) {
+        int used = s->len % 64;
+        if (used == 0 && n >= 64) {
+            // ブロック全体がそろっていればコピーせずに処理する
+            sha256_block(s, p);
+            s->len += 64;
+            p += 64;
+            n -= 64;
+            continue;
+        }
+        int m = 64 - used < n ? 64 - used : n;
+        memcpy(s->buf + used, p, m);
+        s->len += m;
+        p += m;
+        n -= m;
+        if (s->len % 64 == 0) {
+            sha256_block(s, s->buf);
+        }
+    }
+}
+
+// ハッシュ値を16進数の文字列(64文字と'\0')にしてoutに書く
+void sha256_final(Sha256 *s, char *out) {
+    unsigned long bits = s->len * 8;
+    unsigned char pad[72] = {0x80};
+    int padlen = (s->len % 64 < 56 ? 56 : 120) - s->len % 64;
+    for (int i = 0; i < 8; i++) {
+        pad[padlen + i] = bits >> (56 - i * 8);
+    }
+    sha256_update(s, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        sprintf(out + i * 8, "%08x", s->h[i]);
+    }
+}
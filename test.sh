@@ -10,8 +10,20 @@ fi
 for i in `seq $in_cnt`
 do
   ./compiler "in/${i}.txt" > tmp.s
-  gcc -o tmp tmp.s
-  ./tmp
+  # トークナイズ・構文解析・コード生成を同時に行っても、出力は変わらない
+  ./compiler -pipeline "in/${i}.txt" > tmp.actual
+  if ! cmp -s tmp.s tmp.actual ; then
+      echo "Pipelined build differs."
+      exit 1
+  fi
+  # 文ごとに並列にコードを生成しても、出力は変わらない
+  ./compiler -codegen-threads=4 "in/${i}.txt" > tmp.actual
+  if ! cmp -s tmp.s tmp.actual ; then
+      echo "Parallel code generation differs."
+      exit 1
+  fi
+  # アセンブル・リンクして実行する
+  ./compiler -run "in/${i}.txt"
   actual="$?"
   expected="$(cat out/${i}.txt)"
   if [ $actual = $expected ] ; then
@@ -20,7 +32,197 @@ do
       echo "$expected expected, but got $actual."
       exit 1
   fi
+
+  # 実行回数を数えてから、そのプロファイルを使ってコンパイルし直しても結果が変わらないことを確かめる
+  ./compiler -run -fprofile-generate=tmp.prof "in/${i}.txt"
+  ./compiler -fprofile-use=tmp.prof "in/${i}.txt" > tmp.s
+  ./compiler -pipeline -fprofile-use=tmp.prof "in/${i}.txt" > tmp.actual
+  if ! cmp -s tmp.s tmp.actual ; then
+      echo "Pipelined build differs with profile."
+      exit 1
+  fi
+  ./compiler -codegen-threads=4 -fprofile-use=tmp.prof "in/${i}.txt" > tmp.actual
+  if ! cmp -s tmp.s tmp.actual ; then
+      echo "Parallel code generation differs with profile."
+      exit 1
+  fi
+  ./compiler -run -fprofile-use=tmp.prof "in/${i}.txt"
+  actual="$?"
+  if [ $actual = $expected ] ; then
+      echo "got $actual with profile, as expected."
+  else
+      echo "$expected expected with profile, but got $actual."
+      exit 1
+  fi
   echo -e ""
 done
 
-echo OK
\ No newline at end of file
+# -cで作ったオブジェクトファイルをリンクしたものと、-oで作った実行ファイルの終了ステータスを確かめる
+for i in `seq $in_cnt`
+do
+  expected="$(cat out/${i}.txt)"
+  rm -f tmp tmp.o
+  ./compiler -c -o tmp.o "in/${i}.txt" 2> /dev/null && gcc -o tmp tmp.o 2> /dev/null
+  ./tmp
+  actual="$?"
+  if [ $actual != $expected ] ; then
+    echo "$expected expected from -c, but got $actual (in/${i}.txt)."
+    exit 1
+  fi
+  rm -f tmp
+  ./compiler -o tmp "in/${i}.txt" 2> /dev/null
+  ./tmp
+  actual="$?"
+  if [ $actual != $expected ] ; then
+    echo "$expected expected from -o, but got $actual (in/${i}.txt)."
+    exit 1
+  fi
+done
+# コンパイルに失敗しても前の出力は残り、書きかけのファイルもできない -runは125で終了する
+echo 'a = ;' > tmp.txt
+./compiler -o tmp tmp.txt 2> /dev/null
+status="$?"
+./tmp
+actual="$?"
+if [ $status != 1 ] || [ $actual != $expected ] || [ -e tmp.tmp ] ; then
+  echo "Failed -o build damaged the previous output."
+  exit 1
+fi
+./compiler -c -o tmp.o tmp.txt 2> /dev/null
+status="$?"
+if [ $status != 1 ] || ! gcc -o tmp tmp.o 2> /dev/null || [ -e tmp.o.tmp ] ; then
+  echo "Failed -c build damaged the previous output."
+  exit 1
+fi
+./compiler -run tmp.txt 2> /dev/null
+if [ $? != 125 ] ; then
+  echo "-run did not report the compile error as 125."
+  exit 1
+fi
+# 入力ファイルがないときも同じ
+./compiler -run tmp.nonexistent 2> /dev/null
+if [ $? != 125 ] ; then
+  echo "-run did not report the missing input as 125."
+  exit 1
+fi
+# 並列に生成しているスレッドでのエラーも同じ
+echo 'a = 1; 1 = 2; b = 2;' > tmp.txt
+./compiler -run -codegen-threads=4 tmp.txt 2> /dev/null
+if [ $? != 125 ] ; then
+  echo "-run did not report the code generation error as 125."
+  exit 1
+fi
+rm -f tmp tmp.o
+echo "-c and -o build the same programs."
+echo -e ""
+
+# キャッシュ 1回目はミス、2回目はヒットし、どちらもキャッシュなしと同じアセンブリを出力する
+rm -rf tmp.cache
+for i in `seq $in_cnt`
+do
+  ./compiler "in/${i}.txt" > tmp.expected 2> /dev/null
+  for run in miss hit
+  do
+    ./compiler -cache-dir=tmp.cache "in/${i}.txt" > tmp.actual 2> /dev/null
+    if ! cmp -s tmp.expected tmp.actual ; then
+      echo "Cached output differs on $run (in/${i}.txt)."
+      exit 1
+    fi
+  done
+done
+if [ "$(./compiler -cache-dir=tmp.cache -cache-stats | head -2 | tr '\n' ' ')" != "hits: $in_cnt misses: $in_cnt " ] ; then
+  echo "Unexpected cache statistics."
+  exit 1
+fi
+rm -rf tmp.cache
+echo "Cache returns the same assembly."
+echo -e ""
+
+# 監視モード 入力を書き換えるたびに、最初からコンパイルしたのと同じアセンブリを書き出す
+# 変数のオフセット・行番号・カウンタの番号がずれる書き換えと、直前の文にelseを足す書き換えを含める
+# 入力を壊しても終了せず、直せばまたコンパイルし直す
+watch_inputs=(
+  'a = 1;\nb = 2;\nif (a < b) c = a + b; else c = 3;\nwhile (a < 5) a = a + 1;\nreturn c;\n'
+  'a = 1;\nb = 20;\nif (a < b) c = a + b; else c = 3;\nwhile (a < 5) a = a + 1;\nreturn c;\n'
+  'z = 7; if (z) c = 1;\na = 1;\nb = 20;\nif (a < b) c = a + b; else c = 3;\nwhile (a < 5) a = a + 1;\nreturn c;\n'
+  'z = 7; if (z) c = 1; else c = 2;\na = 1;\nb = 20;\nif (a < b) c = a + b; else c = 3;\nwhile (a < 5) a = a + 1;\nreturn c;\n'
+  'z = 7; if (z) c = 1; else c = 2;\na = ;\nb = 20;\nif (a < b) c = a + b; else c = 3;\nwhile (a < 5) a = a + 1;\nreturn c;\n'
+  'z = 7; if (z) c = 1; else c = 2;\nb = 20;\nif (a < b) c = a + b; else c = 3;\nwhile (a < 5) a = a + 1;\nreturn c;\n'
+)
+printf "${watch_inputs[0]}" > tmp.txt
+./compiler -fprofile-generate=tmp.prof -watch=tmp.s tmp.txt 2> /dev/null &
+watcher=$!
+for input in "${watch_inputs[@]}"
+do
+  printf "$input" > tmp.txt
+  if ! ./compiler -fprofile-generate=tmp.prof tmp.txt > tmp.expected 2> /dev/null ; then
+    sleep 0.3
+    if ! kill -0 $watcher 2> /dev/null ; then
+      echo "Watch mode exited on a bad input."
+      exit 1
+    fi
+    continue
+  fi
+  for k in `seq 50` ; do cmp -s tmp.expected tmp.s && break ; sleep 0.1 ; done
+  if ! cmp -s tmp.expected tmp.s ; then
+    kill $watcher
+    echo "Watch mode output differs after an edit."
+    exit 1
+  fi
+done
+kill $watcher
+echo "Watch mode rebuilds the same assembly."
+echo -e ""
+
+# ランダムな入力をトークナイズし、SIMDを使う実装とスカラーの実装、並列にトークナイズした場合とでトークンの列が一致することを確かめる
+lexers="sse2"
+if grep -q avx2 /proc/cpuinfo ; then
+  lexers="sse2 avx2"
+fi
+
+for i in `seq 20`
+do
+  awk -v seed=$i 'BEGIN {
+    srand(seed)
+    n = split("+ - * / ( ) < > = ; { } == != <= >= return if else while for returned iff _ 0 7 42 2147483647", pieces, " ")
+    split(" |\t|\n|\r|\v|\f", spaces, "|")
+    alnum = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_"
+    for (k = 0; k < 5000; k++) {
+      r = rand()
+      if (r < 0.3) {
+        printf "%s", spaces[int(rand() * 6) + 1]
+      } else if (r < 0.4) {
+        len = int(rand() * 70)
+        for (j = 0; j < len; j++) printf "%s", spaces[int(rand() * 6) + 1]
+      } else if (r < 0.55) {
+        len = int(rand() * 70) + 1
+        printf "%s", substr(alnum, int(rand() * 53) + 1, 1)
+        for (j = 1; j < len; j++) printf "%s", substr(alnum, int(rand() * 63) + 1, 1)
+      } else if (r < 0.6) {
+        len = int(rand() * 40) + 1
+        for (j = 0; j < len; j++) printf "%d", int(rand() * 10)
+      } else {
+        printf "%s", pieces[int(rand() * n) + 1]
+      }
+    }
+  }' > tmp.txt
+  ./compiler -lexer=scalar -dump-tokens tmp.txt > tmp.expected 2> /dev/null
+  for lexer in $lexers
+  do
+    ./compiler -lexer=$lexer -dump-tokens tmp.txt > tmp.actual 2> /dev/null
+    if ! cmp -s tmp.expected tmp.actual ; then
+      echo "Token streams differ between scalar and $lexer lexers (seed $i)."
+      exit 1
+    fi
+  done
+  # 並列トークナイズ チャンクの境目で分けてもトークンの列は変わらない
+  ./compiler -lexer=scalar -lexer-threads=4 -dump-tokens tmp.txt > tmp.actual 2> /dev/null
+  if ! cmp -s tmp.expected tmp.actual ; then
+    echo "Token streams differ between serial and parallel lexers (seed $i)."
+    exit 1
+  fi
+done
+echo "Lexers agree on random inputs."
+echo -e ""
+
+echo OK
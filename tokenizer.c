@@ -1,11 +1,22 @@
 #include "header.h"
 
+_Thread_local jmp_buf *error_jmp;
+
+//表示し終えたエラーでコンパイルをやめる error_jmpが設定されていれば、終了せずにそこへ戻る
+void error_exit() {
+    if (error_jmp) {
+        longjmp(*error_jmp, 1);
+    }
+    exit(1);
+}
+
+//エラーを表示して終了する error_jmpが設定されていれば、終了せずにそこへ戻る
 void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
+    error_exit();
 }
 
 void error_at(char *loc, char *fmt, ...) {
@@ -18,7 +29,7 @@ void error_at(char *loc, char *fmt, ...) {
     fprintf(stderr, "^ ");
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
+    error_exit();
 }
 
 int is_alnum(char c) {
@@ -35,126 +46,355 @@ bool at_eof() {
 }
 
 
-Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->str = str;
-    tok->len = len;
-    tok->id = token_count;
-    cur->next = tok;
-    return tok;
-}
+//トークンは直近のTOKEN_RING個だけを使い回す
+//構文解析は現在のトークンと直前のトークンしか見ないので、入力がどれだけ大きくてもメモリは一定で済む
+#define TOKEN_RING 4
+
+Token token_ring[TOKEN_RING];
+int token_ring_pos;
+
+char *token_pos; //次に読む入力の位置
+
+//行番号はトークナイズするスレッドごとに数える
+_Thread_local int token_line;
+_Thread_local char *token_line_start;
 
 bool startswith(char *p, char *q) {
     return memcmp(p, q, strlen(q)) == 0;
 }
 
-//入力をトークンの列に変換する
-Token *tokenize(char *p) {
-    Token head;
-    head.next = NULL;
-    Token *cur = &head;
+//1文字の演算子 strchr("+-*/()<>=;{}", c)の代わりに表を引く
+bool is_punct[256] = {
+    ['+'] = true, ['-'] = true, ['*'] = true, ['/'] = true,
+    ['('] = true, [')'] = true, ['<'] = true, ['>'] = true,
+    ['='] = true, [';'] = true, ['{'] = true, ['}'] = true,
+};
 
-    fprintf(stderr,"\nToken List\n");
+typedef struct {
+    char *name;
+    int len;
+    TokenKind kind;
+} Keyword;
 
-    while (*p) {
-        //空白はスキップする
-        if (isspace(*p)) {
-            p++;
-            continue;
-        }
+Keyword keywords[] = {
+    {"return", 6, TK_RETURN},
+    {"if", 2, TK_IF},
+    {"else", 4, TK_ELSE},
+    {"while", 5, TK_WHILE},
+    {"for", 3, TK_FOR},
+};
 
-        token_count++;
+//pから始まるトークンを1つ読んでtokに入れ、トークンの直後の位置を返す
+//pの前の空白は読み飛ばしてあること 入力の終わりならTK_EOFを入れる 読めない文字ならNULLを返す
+//空白・識別子・数字の連続はscanner.cの関数でまとめて読み飛ばす
+char *lex_token(char *p, Token *tok) {
+    memset(tok, 0, sizeof(Token));
+    tok->str = p;
+    tok->line = token_line;
+    tok->col = p - token_line_start + 1;
 
-        //2文字の演算子
-        //長い演算子から先に処理しないとバグる
-        if (startswith(p, "==") || startswith(p, "!=") ||
-            startswith(p, "<=") || startswith(p, ">=")) {
-            fprintf(stderr,"#%d : %c\n", token_count, *p);
-            cur = new_token(TK_RESERVED, cur, p, 2);
-            p += 2;
-            continue;
-        }
+    if (!*p) {
+        tok->kind = TK_EOF;
+        return p;
+    }
 
-        //char *strchr(char *s, int c)はsにcが含まれているかを検索する関数
-        //含まれていれば最初のその文字へのポインタを、含まれていなければNULLを返す
-        if (strchr("+-*/()<>=;{}", *p)) {
-            fprintf(stderr,"#%d : %c\n", token_count, *p);
-            cur = new_token(TK_RESERVED, cur, p++, 1);
-            continue;
-        }
+    //2文字の演算子
+    //長い演算子から先に処理しないとバグる
+    if (startswith(p, "==") || startswith(p, "!=") ||
+        startswith(p, "<=") || startswith(p, ">=")) {
+        tok->kind = TK_RESERVED;
+        tok->len = 2;
+        return p + 2;
+    }
 
-        if(strncmp(p, "return", 6) == 0 && !is_alnum(p[6])) {
-            fprintf(stderr,"#%d : return\n", token_count);
-            cur = new_token(TK_RETURN, cur, p, 6);
-            p += 6;
-            continue;
-        }
+    if (is_punct[(unsigned char) *p]) {
+        tok->kind = TK_RESERVED;
+        tok->len = 1;
+        return p + 1;
+    }
 
-        if(strncmp(p, "if", 2) == 0 && !is_alnum(p[2])) {
-            fprintf(stderr,"#%d : if\n", token_count);
-            cur = new_token(TK_IF, cur, p, 2);
-            p += 2;
-            continue;
-        }
+    //予約語か変数を表すトークン
+    //識別子の終わりまで読んでから、予約語と一致するかを調べる
+    if (('a' <= *p && *p <= 'z') ||
+        ('A' <= *p && *p <= 'Z') ||
+        (*p == '_')) {
+        char *end = skip_ident(p);
+        int len = end - p;
 
-        if(strncmp(p, "else", 4) == 0 && !is_alnum(p[4])) {
-            fprintf(stderr,"#%d : else\n", token_count);
-            cur = new_token(TK_ELSE, cur, p, 4);
-            p += 4;
-            continue;
+        tok->kind = TK_IDENT;
+        for (int i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+            if (keywords[i].len == len && memcmp(p, keywords[i].name, len) == 0) {
+                tok->kind = keywords[i].kind;
+                break;
+            }
         }
+        tok->len = len;
+        return end;
+    }
+
+    if (isdigit(*p)) {
+        char *end = skip_digit(p);
+        tok->kind = TK_NUM;
+        tok->len = end - p;
+        //long strtol(char *s, char **endptr, int base)は
+        //文字列sをbase進数でlongに変換して返却する
+        //数字の終わりはskip_digitで求めてあるので、値だけを計算させる
+        tok->val = strtol(p, NULL, 10);
+        return end;
+    }
+
+    return NULL;
+}
+
+//読んだトークンを標準エラー出力に表示する -dump-tokensのときだけ使う
+void log_token(Token *tok) {
+    switch (tok->kind) {
+        case TK_RESERVED:
+            fprintf(stderr,"#%d : %c\n", tok->id, *tok->str);
+            break;
+        case TK_IDENT:
+            fprintf(stderr,"#%d :%.*s\n", tok->id, tok->len, tok->str);
+            break;
+        case TK_NUM:
+            fprintf(stderr,"#%d : %d\n", tok->id, tok->val);
+            break;
+        default:
+            fprintf(stderr,"#%d : %.*s\n", tok->id, tok->len, tok->str);
+            break;
+    }
+}
+
+//並列トークナイズ(-lexer-threads=N)
+//入力を、トークンの途中にならない位置でチャンクに分け、各チャンクをスレッドで別々にトークナイズする
+//この言語には文字列もコメントもないので、空白か';' '}'の位置で切ればトークンの途中にはならない
+//  空白の連続の直後  : 空白はどのトークンにも含まれない
+//  ';' '}'の直後     : どちらも1文字のトークンで、2文字の演算子の1文字目にもならない
+//
+//チャンク内の行番号はチャンクの先頭を0行目として数え、next_token()で返すときに通しの番号に直す
+//0行目のトークンの列番号も、チャンクより前の行の先頭が分かってから求める
+
+#define CHUNK_MIN 4096 //これより小さいチャンクには分けない
 
-        if(strncmp(p, "while", 5) == 0 && !is_alnum(p[5])) {
-            fprintf(stderr,"#%d : while\n", token_count);
-            cur = new_token(TK_WHILE, cur, p, 5);
-            p += 5;
-            continue;
+typedef struct {
+    char *begin;
+    char *end;
+    Token *toks;
+    int len;
+    int cap;
+    int lines;          //チャンク内の改行の数
+    char *line_start;   //チャンク内の最後の改行の次の位置
+    bool failed;        //読めない文字でトークナイズを止めた
+} Chunk;
+
+Chunk *chunks;
+int chunk_count;
+atomic_int chunk_next;  //次にトークナイズするチャンク
+
+int chunk_cur;          //next_token()で次に返すトークンの位置
+int chunk_tok;
+int chunk_line = 1;     //chunk_curの先頭の行番号と、その行の先頭
+char *chunk_line_start;
+
+//pから先で、チャンクの境目にしてよい最初の位置を返す
+char *sync_point(char *p) {
+    while (*p && !isspace((unsigned char) *p) && *p != ';' && *p != '}') {
+        p++;
+    }
+    if (*p == ';' || *p == '}') {
+        return p + 1;
+    }
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    return p;
+}
+
+void lex_chunk(Chunk *c) {
+    token_line = 0;
+    token_line_start = c->begin;
+
+    char *p = c->begin;
+    while (p < c->end) {
+        p = skip_space(p);
+        if (p >= c->end) {
+            break;
+        }
+        if (c->len == c->cap) {
+            c->cap = c->cap ? c->cap * 2 : 256;
+            c->toks = realloc(c->toks, sizeof(Token) * c->cap);
         }
+        p = lex_token(p, &c->toks[c->len]);
+        if (!p) {
+            c->failed = true;
+            break;
+        }
+        c->len++;
+    }
+    c->lines = token_line;
+    c->line_start = token_line_start;
+}
 
-        if(strncmp(p, "for", 3) == 0 && !is_alnum(p[3])) {
-            fprintf(stderr,"#%d : for\n", token_count);
-            cur = new_token(TK_FOR, cur, p, 3);
-            p += 3;
-            continue;
+void *lex_worker(void *arg) {
+    for (;;) {
+        int i = atomic_fetch_add(&chunk_next, 1);
+        if (i >= chunk_count) {
+            return NULL;
         }
+        lex_chunk(&chunks[i]);
+    }
+}
 
-        //変数を表すトークン
-        if (('a' <= *p && *p <= 'z') ||
-            ('A' <= *p && *p <= 'Z') ||
-            (*p == '_')) {
-            int len = 0;
-            char *tmp = p;
-            fprintf(stderr,"#%d :", token_count);
-            while (is_alnum(*p)) {
-                len++;
-                fprintf(stderr, "%c", *p);
-                p++;
-            }
-            fprintf(stderr, "\n");
-            cur = new_token(TK_IDENT, cur, tmp, len);
-            continue;
+void tokenize_parallel(char *p, int nthreads) {
+    long size = strlen(p);
+    char *end = p + size;
+
+    //スレッド数より多めに分けて、チャンクごとの重さの偏りをならす
+    long step = size / (nthreads * 4);
+    if (step < CHUNK_MIN) {
+        step = CHUNK_MIN;
+    }
+    int cap = size / step + 2;
+    chunks = calloc(cap, sizeof(Chunk));
+    for (char *begin = p; begin < end; ) {
+        char *q = end - begin > step ? sync_point(begin + step) : end;
+        chunks[chunk_count].begin = begin;
+        chunks[chunk_count].end = q;
+        chunk_count++;
+        begin = q;
+    }
+    chunk_line_start = p;
+
+    if (nthreads > chunk_count) {
+        nthreads = chunk_count;
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, lex_worker, NULL) != 0) {
+            error("スレッドを作れません");
         }
+    }
+    lex_worker(NULL);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    token_pos = end;
+}
 
-        if (isdigit(*p)) {
-            cur = new_token(TK_NUM, cur, p, 0);
-            char *q = p;
-            //long strtol(char *s, char **endptr, int base)は
-            //文字列sをbase進数でlongに変換して返却する
-            //変換できた最後の文字の次の文字を指すポインタをendptrに格納する(今回は現在読んでいる数字の次)
-            cur->val = strtol(p, &p, 10);
-            fprintf(stderr,"#%d : %d\n", token_count, cur->val);
-            cur->len = p - q;
-            continue;
+//チャンクごとにトークナイズしたトークンを、順に取り出してtokに入れる
+//読めない文字で止まったチャンクまで来たら、1つのスレッドで読んだときと同じくそこでfalseを返す
+bool take_token(Token *tok) {
+    while (chunk_cur < chunk_count && chunk_tok == chunks[chunk_cur].len) {
+        Chunk *c = &chunks[chunk_cur];
+        if (c->failed) {
+            return false;
         }
+        if (c->lines) {
+            chunk_line += c->lines;
+            chunk_line_start = c->line_start;
+        }
+        free(c->toks);
+        chunk_cur++;
+        chunk_tok = 0;
+    }
+
+    if (chunk_cur == chunk_count) {
+        memset(tok, 0, sizeof(Token));
+        tok->kind = TK_EOF;
+        tok->str = token_pos;
+        tok->line = chunk_line;
+        tok->col = token_pos - chunk_line_start + 1;
+        return true;
+    }
+
+    *tok = chunks[chunk_cur].toks[chunk_tok++];
+    if (tok->line == 0) {
+        tok->col = tok->str - chunk_line_start + 1;
+    }
+    tok->line += chunk_line;
+    return true;
+}
 
-        fprintf(stderr, "トークナイズできません\n");
-        exit(1);
+//入力pのトークナイズを始める
+//トークンは構文解析が必要とするたびにnext_token()で1つずつ読む
+//-lexer-threadsが指定されていれば、ここで入力全体を複数のスレッドでトークナイズしておく
+void init_tokenizer(char *p) {
+    token_pos = p;
+    token_line = 1;
+    token_line_start = p;
+
+    fprintf(stderr,"\nToken List\n");
+
+    if (lexer_threads > 1) {
+        tokenize_parallel(p, lexer_threads);
     }
+}
 
-    new_token(TK_EOF, cur, p, 0);
+//次のトークンを1つ読んでtokに入れる 読めない文字ならfalseを返す
+bool read_token(Token *tok) {
+    if (chunk_count) {
+        return take_token(tok);
+    }
+    char *p = skip_space(token_pos);
+    char *end = lex_token(p, tok);
+    if (!end) {
+        return false;
+    }
+    token_pos = end;
+    return true;
+}
 
-    fprintf(stderr, "\nInput successfully tokenized.\n\n");
+//次のトークンを1つ読んで返す 番号はここで振り、読んだトークンを表示する
+//-pipelineでは、別のスレッドが読んだトークンを待ち行列から受け取る
+Token *next_token() {
+    Token *tok = &token_ring[token_ring_pos];
+    token_ring_pos = (token_ring_pos + 1) % TOKEN_RING;
 
-    return head.next;
+    bool ok;
+    if (token_queue) {
+        queue_pop(token_queue, tok);
+        ok = tok->str != NULL;
+    } else {
+        ok = read_token(tok);
+    }
+    if (!ok) {
+        error("トークナイズできません");
+    }
+
+    if (tok->kind == TK_EOF) {
+        tok->id = token_count;
+        fprintf(stderr, "\nInput successfully tokenized.\n\n");
+        return tok;
+    }
+    tok->id = ++token_count;
+    //1トークンごとの表示はトークナイズより重いので、-dump-tokensのときだけ行う
+    if (opt_dump_tokens) {
+        log_token(tok);
+    }
+    return tok;
+}
+
+//入力を最後までトークナイズし、トークンの数だけを標準出力に書く(-lex-only)
+//トークンごとには何も出力しないので、トークナイズにかかる時間を測るのに使う
+void count_tokens() {
+    while (next_token()->kind != TK_EOF) {
+    }
+    printf("%d tokens\n", token_count);
+}
+
+//トークンの列を1行に1つずつ標準出力に書き出す(-dump-tokens) トークナイザの実装どうしを比べるのに使う
+void dump_tokens() {
+    //トークンごとの表示で1つずつwriteしないよう、標準エラー出力もバッファに溜める
+    setvbuf(stderr, NULL, _IOFBF, 1 << 16);
+    for (;;) {
+        Token *tok = next_token();
+        printf("%d %s %d:%d %.*s", tok->id, token_name[tok->kind], tok->line, tok->col, tok->len, tok->str);
+        if (tok->kind == TK_NUM) {
+            printf(" = %d", tok->val);
+        }
+        printf("\n");
+        if (tok->kind == TK_EOF) {
+            return;
+        }
+    }
 }
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include "header.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+// 監視モード(-watch=FILE)
+// 入力が書き換えられるたびにコンパイルし直し、アセンブリをFILEに書く
+// 前回のコンパイルの結果を文(codeの要素)ごとに覚えておき、変わった部分だけを解析・生成し直す
+//
+//   1. 前回の入力と新しい入力を比べ、先頭と末尾で一致する部分を求める
+//   2. 変わった範囲より前で終わる文はそのまま使う
+//      ただし最後の1つには"else"が続いて文が変わるかもしれないので、その文からトークナイズ・構文解析をやり直す
+//   3. 末尾の一致部分にある前回の文の先頭まで来たら解析を止める
+//      そこから先はトークンの列が前回と同じなので、解析の結果も同じになる
+//   4. 止めた位置より後の文は、前回のアセンブリを使い回す
+//      文の番号・行番号・変数のオフセット・カウンタの番号がずれていれば、アセンブリの中の
+//      .L<文の番号>_、.loc、[rbp-N]、__prof_counts+Nを書き換える(emitter.cのrelocate_asm)
+// 解析・生成し直すのは変わった文だけだが、入力の比較・使い回す文の書き換え・出力全体の書き出しは
+// 毎回行うので、1回の書き換えにかかる時間は入力の大きさに比例する
+// 変わった範囲と同じ行にある文は列番号がずれるので、末尾の一致部分にあっても解析し直す
+// -fprofile-useのプロファイルは入力が変わると合わなくなるので、そのときは毎回すべてを作り直す
+
+typedef struct {
+    char *name;
+    int len;
+    int offset;     // アセンブリを生成したときのオフセット
+} VarRef;
+
+typedef struct {
+    int start;      // 文の最初のトークンの位置(入力の先頭からのバイト数)
+    int line;       // 文の最初のトークンの行
+    int prof_base;  // 文が使う最初のカウンタの番号
+    int prof_len;   // 文が使うカウンタの個数
+    LVar *locals;   // 文を読み終えたときの変数の一覧
+    VarRef *vars;   // 文が参照する変数 最初に参照する順に並べる
+    int nvars;
+    bool vars_moved; // 変数のオフセットが、アセンブリを生成したときと変わった
+    Node *node;     // 構文解析した木 生成し終えたら使わない
+    RootOut out;    // 生成したアセンブリ
+    int gen_root;   // アセンブリを生成したときの文の番号・行・カウンタの番号
+    int gen_line;
+    int gen_prof;
+} Fragment;
+
+char *watch_input;  // 前回コンパイルした入力
+int watch_len;
+Fragment *frags;    // 前回コンパイルした文
+int frag_count;
+Fragment *added;    // コンパイルし直している文 エラーになったら捨てる
+int added_count;
+int added_cap;
+
+LVar *lookup_var(LVar *list, char *name, int len) {
+    for (LVar *var = list; var; var = var->next) {
+        if (var->len == len && !memcmp(name, var->name, len)) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+// 一覧の中の変数のオフセット 文が参照する変数は、その文を読み終えたときの一覧に必ずある
+int var_offset(LVar *list, char *name, int len) {
+    LVar *var = lookup_var(list, name, len);
+    assert(var);
+    return var->offset;
+}
+
+// 2つの変数の一覧が、同じ変数に同じオフセットを割り当てているか
+bool same_vars(LVar *a, LVar *b) {
+    if (a == b) {
+        return true;
+    }
+    // オフセットは8ずつ増えるので、先頭のオフセットが同じなら変数の個数も同じ
+    if (!a || !b || a->offset != b->offset) {
+        return false;
+    }
+    for (LVar *var = a; var; var = var->next) {
+        LVar *other = lookup_var(b, var->name, var->len);
+        if (!other || other->offset != var->offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 前回の入力で位置startから始まる文の番号を返す なければ-1
+int find_fragment(int start) {
+    int lo = 0, hi = frag_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (frags[mid].start < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < frag_count && frags[lo].start == start ? lo : -1;
+}
+
+// 前回の文iの終わり、つまり次の文の先頭の位置
+int fragment_end(int i) {
+    return i + 1 < frag_count ? frags[i + 1].start : watch_len;
+}
+
+// 文が参照する変数を、最初に参照する順に集める
+// 構文解析は変数をトークンの順に見つけるので、文の範囲をもう一度トークナイズして識別子を拾えばよい
+void collect_vars(Fragment *f, char *text, int end) {
+    int line = token_line;
+    char *line_start = token_line_start;
+    int cap = 0;
+
+    char *p = text + f->start;
+    for (;;) {
+        p = skip_space(p);
+        if (p >= text + end) {
+            break;
+        }
+        Token tok;
+        p = lex_token(p, &tok);
+        if (!p) {
+            break;
+        }
+        if (tok.kind != TK_IDENT) {
+            continue;
+        }
+        bool seen = false;
+        for (int i = 0; i < f->nvars && !seen; i++) {
+            seen = f->vars[i].len == tok.len && !memcmp(f->vars[i].name, tok.str, tok.len);
+        }
+        if (seen) {
+            continue;
+        }
+        if (f->nvars == cap) {
+            cap = cap ? cap * 2 : 4;
+            f->vars = realloc(f->vars, sizeof(VarRef) * cap);
+        }
+        f->vars[f->nvars++] = (VarRef){strndup(tok.str, tok.len), tok.len, var_offset(f->locals, tok.str, tok.len)};
+    }
+
+    token_line = line;
+    token_line_start = line_start;
+}
+
+// 構文解析で増えた変数の名前は入力を指しているので、入力を捨てられるようにコピーする
+void own_names(LVar *list, LVar *until) {
+    for (LVar *var = list; var != until; var = var->next) {
+        var->name = strndup(var->name, var->len);
+    }
+}
+
+// 前の文までの変数の一覧prevに、文fが参照する変数を足し直す
+void replay_vars(Fragment *f, LVar *prev) {
+    LVar *list = prev;
+    for (int i = 0; i < f->nvars; i++) {
+        VarRef *ref = &f->vars[i];
+        LVar *var = lookup_var(list, ref->name, ref->len);
+        if (!var) {
+            var = calloc(1, sizeof(LVar));
+            var->next = list;
+            var->name = strndup(ref->name, ref->len);
+            var->len = ref->len;
+            var->offset = list ? list->offset + 8 : 8;
+            list = var;
+        }
+        if (var->offset != ref->offset) {
+            f->vars_moved = true;
+        }
+    }
+    f->locals = list;
+}
+
+void free_fragment(Fragment *f) {
+    free_tree(f->node);
+    free(f->out.buf);
+    for (int i = 0; i < f->nvars; i++) {
+        free(f->vars[i].name);
+    }
+    free(f->vars);
+}
+
+// アセンブリの中の変数のオフセットoffsetを、今のオフセットに直す
+int moved_offset(Fragment *f, int offset) {
+    for (int i = 0; i < f->nvars; i++) {
+        if (f->vars[i].offset == offset) {
+            return var_offset(f->locals, f->vars[i].name, f->vars[i].len);
+        }
+    }
+    return offset;
+}
+
+// 文fのアセンブリの中の数を、今の文の状態に合わせて直す 文の番号は先にgen_rootに入れておく
+long fix_fragment(RelocKind kind, long val, void *arg) {
+    Fragment *f = arg;
+    switch (kind) {
+    case RELOC_ROOT:
+        return f->gen_root;
+    case RELOC_LINE:
+        return val + f->line - f->gen_line;
+    case RELOC_VAR:
+        return moved_offset(f, val);
+    case RELOC_COUNTER:
+        return val + (f->prof_base - f->gen_prof) * 8L;
+    }
+    return val;
+}
+
+// 文rootのアセンブリを、生成したときからずれた文の番号・行・変数のオフセット・カウンタの番号に合わせて書き換える
+void relocate(Fragment *f, int root) {
+    char *buf;
+    size_t len;
+    FILE *fp = open_memstream(&buf, &len);
+    if (!fp) {
+        error("出力用のバッファを作れません");
+    }
+    f->gen_root = root;
+    relocate_asm(fp, f->out.buf, f->out.len, fix_fragment, f);
+    fclose(fp);
+
+    free(f->out.buf);
+    f->out.buf = buf;
+    f->out.len = len;
+    f->gen_line = f->line;
+    f->gen_prof = f->prof_base;
+    for (int i = 0; i < f->nvars; i++) {
+        f->vars[i].offset = var_offset(f->locals, f->vars[i].name, f->vars[i].len);
+    }
+    f->vars_moved = false;
+}
+
+// 覚えている文のアセンブリをつないで、出力先に書く
+// 書き終えてから置き換えるので、読む側が書きかけのファイルを見ることはない
+void write_output(char *path) {
+    char *tmp = malloc(strlen(watch_output) + 5);
+    sprintf(tmp, "%s.tmp", watch_output);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "warning: %sに書き込めません\n", tmp);
+        free(tmp);
+        return;
+    }
+    fflush(stdout);
+    int saved_stdout = dup(1);
+    dup2(fd, 1);
+    close(fd);
+
+    begin_root(0, stdout);
+    cold_started = false;
+    gen_prologue(path);
+    for (int i = 0; i < frag_count; i++) {
+        Fragment *f = &frags[i];
+        if (f->gen_root != i || f->gen_line != f->line || f->gen_prof != f->prof_base || f->vars_moved) {
+            relocate(f, i);
+        }
+        write_root(&f->out);
+    }
+    begin_root(frag_count, stdout);
+    gen_epilogue();
+    emit_directive(".cfi_endproc");
+    emit_directive(".size main, .-main");
+    gen_profile_runtime();
+
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+    if (rename(tmp, watch_output) != 0) {
+        fprintf(stderr, "warning: %sに書き込めません\n", watch_output);
+    }
+    free(tmp);
+}
+
+// textを前回の入力と比べ、変わった文だけをコンパイルし直してwatch_outputに書く
+// textは成功すれば次の比較のために持っておき、エラーなら呼び出し側が捨てる
+// エラーは構文解析と生成の途中でしか起きないので、それまでは前回の状態を書き換えない
+void rebuild(char *text, char *path) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int len = strlen(text);
+    int max = len < watch_len ? len : watch_len;
+    int pre = 0;
+    while (pre < max && text[pre] == watch_input[pre]) {
+        pre++;
+    }
+    if (pre == len && len == watch_len) {
+        free(text);
+        return;
+    }
+    int suf = 0;
+    while (suf < max - pre && text[len - 1 - suf] == watch_input[watch_len - 1 - suf]) {
+        suf++;
+    }
+    int delta = len - watch_len;
+
+    // 変わった範囲より前で終わる文の個数を数え、最後の1つから読み直す
+    int lo = 0, hi = frag_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (fragment_end(mid) <= pre) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int first = lo > 0 ? lo - 1 : 0;
+
+    // 末尾の一致部分のうち、変わった範囲の次の行より後から始まる文を使い回す
+    int sync = watch_len - suf;
+    while (sync < watch_len && watch_input[sync] != '\n') {
+        sync++;
+    }
+    if (profile_use) {
+        first = 0;
+        sync = watch_len;
+    }
+
+    // 読み直す最初の文の先頭から、トークナイズと構文解析を再開する
+    int pos = first > 0 ? frags[first].start : 0;
+    char *line_start = text + pos;
+    while (line_start > text && line_start[-1] != '\n') {
+        line_start--;
+    }
+    user_input = text;
+    token_pos = text + pos;
+    token_line = first > 0 ? frags[first].line : 1;
+    token_line_start = line_start;
+    locals = first > 0 ? frags[first - 1].locals : NULL;
+    prof_count = first > 0 ? frags[first - 1].prof_base + frags[first - 1].prof_len : 0;
+
+    added_count = 0;
+    int resume = frag_count;    // 使い回す最初の前回の文
+    token = next_token();
+    while (!at_eof()) {
+        int start = token->str - text;
+        if (start - delta > sync) {
+            int i = find_fragment(start - delta);
+            if (i >= 0) {
+                resume = i;
+                break;
+            }
+        }
+        if (added_count == added_cap) {
+            added_cap = added_cap ? added_cap * 2 : 16;
+            added = realloc(added, sizeof(Fragment) * added_cap);
+        }
+        Fragment *f = &added[added_count++];
+        memset(f, 0, sizeof(Fragment));
+        f->start = start;
+        f->line = token->line;
+        f->prof_base = prof_count;
+        LVar *prev = locals;
+        f->node = stmt();
+        f->prof_len = prof_count - f->prof_base;
+        f->locals = locals;
+        own_names(locals, prev);
+        collect_vars(f, text, token->str - text);
+    }
+
+    // 使い回す文の行番号・カウンタの番号のずれ 変数の一覧が変わっていれば、オフセットも付け直す
+    int line_shift = 0, prof_shift = 0;
+    bool vars_changed = false;
+    if (resume < frag_count) {
+        line_shift = token->line - frags[resume].line;
+        prof_shift = prof_count - frags[resume].prof_base;
+        vars_changed = !same_vars(locals, resume > 0 ? frags[resume - 1].locals : NULL);
+        Fragment *last = &frags[frag_count - 1];
+        prof_count = last->prof_base + last->prof_len + prof_shift;
+    }
+
+    if (profile_generate || profile_use) {
+        source_hash = hash_source(text);
+    }
+    if (profile_use) {
+        load_profile(profile_use);
+    }
+    for (int i = 0; i < added_count; i++) {
+        Fragment *f = &added[i];
+        gen_root(first + i, f->node, &f->out);
+        free_tree(f->node);
+        f->node = NULL;
+        f->gen_root = first + i;
+        f->gen_line = f->line;
+        f->gen_prof = f->prof_base;
+    }
+
+    // ここから先はエラーにならないので、前回の状態を置き換える
+    int recompiled = added_count;
+    int n = first + added_count + frag_count - resume;
+    Fragment *next = malloc(sizeof(Fragment) * (n + 1));
+    memcpy(next, frags, sizeof(Fragment) * first);
+    memcpy(next + first, added, sizeof(Fragment) * added_count);
+    for (int i = resume; i < frag_count; i++) {
+        Fragment *f = &next[first + added_count + i - resume];
+        *f = frags[i];
+        f->start += delta;
+        f->line += line_shift;
+        f->prof_base += prof_shift;
+        if (vars_changed) {
+            replay_vars(f, f > next ? f[-1].locals : NULL);
+        }
+    }
+    for (int i = first; i < resume; i++) {
+        free_fragment(&frags[i]);
+    }
+    free(frags);
+    added_count = 0;
+    free(watch_input);
+    frags = next;
+    frag_count = n;
+    watch_input = text;
+    watch_len = len;
+
+    write_output(path);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    fprintf(stderr, "%sに書き出しました %d個の文のうち%d個をコンパイルし直しました (%.2f ms)\n",
+            watch_output, n, recompiled, ms);
+}
+
+// 入力を読んでコンパイルし直す エラーなら前回の状態を残し、入力が直るのを待つ
+void try_rebuild(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        // エディタが置き換えている途中 置き換え終わればもう一度通知が来る
+        return;
+    }
+    char *text = read_stream(fd);
+
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        // 途中まで読んだ文を捨てる 解析の途中だった文の木と、増えた変数は捨てきれない
+        error_jmp = NULL;
+        for (int i = 0; i < added_count; i++) {
+            free_fragment(&added[i]);
+        }
+        added_count = 0;
+        free(text);
+        fprintf(stderr, "入力を直すとコンパイルし直します\n");
+        return;
+    }
+    error_jmp = &jb;
+    rebuild(text, path);
+    error_jmp = NULL;
+}
+
+// 監視しているディレクトリで、名前がnameのファイルが書き換えられるまで待つ
+void wait_change(int fd, char *name) {
+    for (;;) {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        long n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            error("入力を監視できません");
+        }
+        bool changed = false;
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            changed |= ev->len && strcmp(ev->name, name) == 0;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        if (changed) {
+            return;
+        }
+    }
+}
+
+int watch(char *path) {
+    if (strcmp(path, "-") == 0) {
+        error("-watchには入力ファイルを指定してください");
+    }
+
+    // エディタは別のファイルに書いてから名前を付け替えることがあるので、入力のあるディレクトリを監視する
+    // 最初のコンパイルより前に監視を始め、その間の書き換えを取りこぼさないようにする
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash - path + 1) : ".";
+    char *name = slash ? slash + 1 : path;
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        error("%sを監視できません", dir);
+    }
+
+    // トークンは読み直す範囲だけを1つのスレッドで読む
+    lexer_threads = 0;
+    init_scanner(lexer_mode);
+    watch_input = calloc(1, 1);
+
+    for (;;) {
+        try_rebuild(path);
+        wait_change(fd, name);
+    }
+}